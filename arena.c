@@ -0,0 +1,133 @@
+/*
+MIT License
+
+Copyright (c) 2020 Kevin Huang
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include <stdlib.h>
+#include "thread_internal.h"
+
+#define ARENA_ALIGN		16
+#define ARENA_ROUND(n)	(((n) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+#define CHUNK_HEADER	ARENA_ROUND(sizeof(th_arena_chunk_t))
+#define CHUNK_DATA(c)	((char *)(c) + CHUNK_HEADER)
+
+static th_arena_chunk_t *chunk_get(th_system_t *s)
+{
+	th_arena_chunk_t *c = s->chunk_cache;
+
+	if (c) {
+		s->chunk_cache = c->next;
+		s->chunk_cache_count--;
+		return c;
+	}
+
+	c = (th_arena_chunk_t *)malloc(CHUNK_HEADER + THREAD_ARENA_CHUNK_SIZE);
+	if (c)
+		c->size = THREAD_ARENA_CHUNK_SIZE;
+	return c;
+}
+
+static void chunk_put(th_system_t *s, th_arena_chunk_t *c)
+{
+	if (c->size == THREAD_ARENA_CHUNK_SIZE &&
+		s->chunk_cache_count < THREAD_ARENA_CACHE_MAX) {
+		c->next = s->chunk_cache;
+		s->chunk_cache = c;
+		s->chunk_cache_count++;
+	} else {
+		free(c);
+	}
+}
+
+void *thread_alloc(size_t size)
+{
+	th_system_t *s = THREAD;
+	th_arena_t *ar = &s->active_thread->th_arena;
+	th_arena_chunk_t *c;
+	char *p;
+
+	size = ARENA_ROUND(size);
+	if ((size_t)(ar->ar_end - ar->ar_ptr) >= size) {
+		p = ar->ar_ptr;
+		ar->ar_ptr += size;
+		return p;
+	}
+
+	if (size > THREAD_ARENA_CHUNK_SIZE) {
+		/* oversized, give it a private chunk behind the current one */
+		c = (th_arena_chunk_t *)malloc(CHUNK_HEADER + size);
+		if (c == NULL)
+			return NULL;
+		c->size = size;
+		if (ar->ar_chunks) {
+			c->next = ar->ar_chunks->next;
+			ar->ar_chunks->next = c;
+		} else {
+			c->next = NULL;
+			ar->ar_chunks = c;
+		}
+		return CHUNK_DATA(c);
+	}
+
+	if ((c = chunk_get(s)) == NULL)
+		return NULL;
+	c->next = ar->ar_chunks;
+	ar->ar_chunks = c;
+
+	p = CHUNK_DATA(c);
+	ar->ar_ptr = p + size;
+	ar->ar_end = p + c->size;
+	return p;
+}
+
+void thread_arena_reset(void)
+{
+	thread_arena_release( THREAD->active_thread );
+}
+
+/* hand every chunk of the thread back to its scheduler */
+void thread_arena_release(thread_t *th)
+{
+	th_arena_t *ar = &th->th_arena;
+	th_arena_chunk_t *c, *next;
+
+	for (c=ar->ar_chunks; c; c=next) {
+		next = c->next;
+		chunk_put(th->th_sched, c);
+	}
+
+	ar->ar_chunks = NULL;
+	ar->ar_ptr = NULL;
+	ar->ar_end = NULL;
+}
+
+void thread_arena_cache_free(th_system_t *s)
+{
+	th_arena_chunk_t *c, *next;
+
+	for (c=s->chunk_cache; c; c=next) {
+		next = c->next;
+		free(c);
+	}
+
+	s->chunk_cache = NULL;
+	s->chunk_cache_count = 0;
+}
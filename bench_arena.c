@@ -0,0 +1,118 @@
+/*
+MIT License
+
+Copyright (c) 2020 Kevin Huang
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+/*
+ * thread_alloc() arena against glibc malloc/free for a request-shaped
+ * pattern: every request makes a burst of small allocations of mixed
+ * size, touches them and drops all of them when the request ends
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "thread.h"
+
+#define REQUESTS		20000
+#define ALLOCS_PER_REQ	200
+#define NUM_WORKERS		16
+
+static size_t sizes[ALLOCS_PER_REQ];
+static int finished;
+
+static uint64_t now_ns(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000000ull + (uint64_t)tv.tv_usec * 1000;
+}
+
+static void malloc_worker(void *param)
+{
+	void *ptrs[ALLOCS_PER_REQ];
+	int r, i;
+
+	for (r=0; r<REQUESTS/NUM_WORKERS; r++) {
+		for (i=0; i<ALLOCS_PER_REQ; i++) {
+			ptrs[i] = malloc(sizes[i]);
+			memset(ptrs[i], i, 8);
+		}
+		for (i=0; i<ALLOCS_PER_REQ; i++)
+			free(ptrs[i]);
+		thread_yield(NULL);
+	}
+	finished++;
+}
+
+static void arena_worker(void *param)
+{
+	void *p;
+	int r, i;
+
+	for (r=0; r<REQUESTS/NUM_WORKERS; r++) {
+		for (i=0; i<ALLOCS_PER_REQ; i++) {
+			p = thread_alloc(sizes[i]);
+			memset(p, i, 8);
+		}
+		thread_arena_reset();
+		thread_yield(NULL);
+	}
+	finished++;
+}
+
+static uint64_t run(thread_func_t func)
+{
+	uint64_t start = now_ns();
+	int i;
+
+	finished = 0;
+	for (i=0; i<NUM_WORKERS; i++)
+		thread_create("bench", func, NULL, 0);
+	while (finished < NUM_WORKERS)
+		thread_yield(NULL);
+
+	return now_ns() - start;
+}
+
+int
+main(int argc, char **argv)
+{
+	uint64_t t_malloc, t_arena;
+	int i;
+
+	/* mostly small headers and strings, an occasional buffer */
+	srand(1);
+	for (i=0; i<ALLOCS_PER_REQ; i++)
+		sizes[i] = (i % 50 == 0) ? 4096 : 16 + rand() % 240;
+
+	initial_thread_system();
+
+	run(arena_worker); /* warm the chunk cache */
+	t_malloc = run(malloc_worker);
+	t_arena = run(arena_worker);
+
+	printf("%d requests x %d allocations, %d threads\n", REQUESTS, ALLOCS_PER_REQ, NUM_WORKERS);
+	printf("malloc/free : %8.1f ns/request\n", (double)t_malloc / REQUESTS);
+	printf("thread_alloc: %8.1f ns/request\n", (double)t_arena / REQUESTS);
+
+	return 0;
+}
@@ -0,0 +1,119 @@
+/*
+MIT License
+
+Copyright (c) 2020 Kevin Huang
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include <stdlib.h>
+#include "thread_internal.h"
+
+/*
+ * a generator is a parked (SUSPEND) thread; thread_gen_next() and
+ * thread_gen_yield() hand control back and forth with one context
+ * switch each, the side that is not running stays SUSPEND so the
+ * scheduler never picks it
+ */
+struct _thread_gen {
+	thread_t		*g_thread;
+	thread_t		*g_caller;	/* consumer waiting in thread_gen_next() */
+	void			*g_value;
+	int				g_done;
+	thread_func_t	g_func;
+	void			*g_param;
+};
+
+static void gen_stub(void *param)
+{
+	thread_gen_t *g = (thread_gen_t *)param;
+	thread_t *th = g->g_thread;
+
+	g->g_func( g->g_param );
+	g->g_done = 1;
+	g->g_value = NULL;
+
+	/* let the consumer run again, thread_stub retires this thread */
+	g->g_caller->th_state = THREAD_STATE_READY;
+	th->th_state = THREAD_STATE_SUSPEND;
+}
+
+thread_gen_t *thread_gen_create(
+	const char *name,
+	thread_func_t func,
+	void *param,
+	int stacksize)
+{
+	thread_gen_t *g = (thread_gen_t *)malloc(sizeof(thread_gen_t));
+
+	if (g == NULL)
+		return NULL;
+
+	g->g_caller = NULL;
+	g->g_value = NULL;
+	g->g_done = 0;
+	g->g_func = func;
+	g->g_param = param;
+
+	if ((g->g_thread = thread_create(name, gen_stub, g, stacksize)) == NULL) {
+		free(g);
+		return NULL;
+	}
+	thread_suspend(g->g_thread); /* runs only from thread_gen_next() */
+
+	return g;
+}
+
+void *thread_gen_next(thread_gen_t *g)
+{
+	if (g->g_done)
+		return NULL;
+
+	g->g_caller = THREAD->active_thread;
+	thread_handoff( g->g_caller, g->g_thread );
+
+	return g->g_value;
+}
+
+int thread_gen_yield(void *value)
+{
+	thread_t *th = THREAD->active_thread;
+	thread_gen_t *g;
+
+	if (th->th_entry != gen_stub)
+		return -1; /* not a generator */
+
+	g = (thread_gen_t *)th->th_param;
+	g->g_value = value;
+	thread_handoff( th, g->g_caller );
+
+	return 0;
+}
+
+int thread_gen_done(thread_gen_t *g)
+{
+	return g->g_done;
+}
+
+void thread_gen_free(thread_gen_t *g)
+{
+	/* an unfinished generator is dropped where it is parked */
+	if (!g->g_done)
+		thread_terminate( g->g_thread );
+	free(g);
+}
@@ -36,6 +36,11 @@ void worker_func(void *param)
 	printf("end of workder (%s)\n", thread_self()->th_name);
 }
 
+static void dump_timer(thread_timer_t *timer, void *arg)
+{
+	thread_dump();
+}
+
 int
 main(int argc, char **argv)
 {
@@ -45,11 +50,15 @@ main(int argc, char **argv)
 	thread_create("thread2", worker_func, (void *)500, 64*KB);
 	thread_create("thread3", worker_func, (void *)800, 64*KB);
 
+	/* "./test <file>" publishes live stats for ultop */
+	if (argc > 1)
+		thread_stats_export(argv[1], 1000);
+
 	/* dump thread system status every 5s */
-	while (1) {
-		thread_sleep(5000);
-		thread_dump();
-	}
+	thread_timer_add(5000, 5000, dump_timer, NULL);
+
+	/* nothing else to do here, let the workers and the timer run */
+	thread_suspend(NULL);
 
 	return 0;
 }
@@ -0,0 +1,176 @@
+/*
+MIT License
+
+Copyright (c) 2020 Kevin Huang
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "thread_internal.h"
+
+/*
+ * offload pool: calls that cannot be made non-blocking run on helper
+ * pthreads while the calling user thread is suspended; the result comes
+ * back through the owning scheduler's remote wakeup list
+ */
+typedef struct _offload_job {
+	th_remote_t		j_remote;
+	offload_func_t	j_func;
+	void			*j_arg;
+	void			*j_result;
+	th_system_t		*j_sched;
+	uint64_t		j_submit_ns;
+	struct _offload_job *j_next;
+} offload_job_t;
+
+typedef struct _offload_pool {
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+	offload_job_t	*head;
+	offload_job_t	*tail;
+	pthread_t		helper[THREAD_OFFLOAD_MAX_THREADS];
+	thread_offload_stats_t stats;
+} offload_pool_t;
+
+static offload_pool_t POOL = {
+	PTHREAD_MUTEX_INITIALIZER,
+	PTHREAD_COND_INITIALIZER,
+	NULL,
+	NULL,
+	{ 0 },
+	{ 0 },
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void *helper_main(void *arg)
+{
+	offload_job_t *job;
+	uint64_t start, wait;
+
+	pthread_mutex_lock(&POOL.lock);
+	while (1) {
+		while (POOL.head == NULL)
+			pthread_cond_wait(&POOL.cond, &POOL.lock);
+
+		job = POOL.head;
+		if ((POOL.head = job->j_next) == NULL)
+			POOL.tail = NULL;
+
+		start = now_ns();
+		wait = start - job->j_submit_ns;
+		POOL.stats.queue_depth--;
+		POOL.stats.wait_ns_total += wait;
+		if (wait > POOL.stats.wait_ns_max)
+			POOL.stats.wait_ns_max = wait;
+		POOL.stats.busy++;
+		pthread_mutex_unlock(&POOL.lock);
+
+		job->j_result = job->j_func(job->j_arg);
+
+		pthread_mutex_lock(&POOL.lock);
+		POOL.stats.busy--;
+		POOL.stats.completed++;
+		POOL.stats.run_ns_total += now_ns() - start;
+
+		/* hand the job back, it lives on the caller's stack */
+		thread_remote_post(job->j_sched, &job->j_remote);
+	}
+
+	return NULL;
+}
+
+/* start helpers until NTHREADS are running */
+int thread_offload_init(int nthreads)
+{
+	int ret = 0;
+
+	if (nthreads > THREAD_OFFLOAD_MAX_THREADS)
+		nthreads = THREAD_OFFLOAD_MAX_THREADS;
+
+	pthread_mutex_lock(&POOL.lock);
+	while (POOL.stats.threads < nthreads) {
+		if (pthread_create(&POOL.helper[POOL.stats.threads], NULL, helper_main, NULL) != 0) {
+			ret = -1;
+			break;
+		}
+		pthread_detach(POOL.helper[POOL.stats.threads]);
+		__atomic_store_n(&POOL.stats.threads, POOL.stats.threads + 1, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&POOL.lock);
+
+	return ret;
+}
+
+void *thread_offload(offload_func_t func, void *arg)
+{
+	th_system_t *s = THREAD;
+	offload_job_t job;
+
+	/* helpers may be started from another OS thread, read the count atomically */
+	if (__atomic_load_n(&POOL.stats.threads, __ATOMIC_ACQUIRE) == 0 &&
+		thread_offload_init(THREAD_OFFLOAD_DEFAULT_THREADS) < 0 &&
+		__atomic_load_n(&POOL.stats.threads, __ATOMIC_ACQUIRE) == 0)
+		return func(arg); /* no helper, block here */
+
+	if (thread_remote_prepare(s) < 0)
+		return func(arg);
+
+	memset(&job, 0, sizeof(job));
+	job.j_remote.th = s->active_thread;
+	job.j_func = func;
+	job.j_arg = arg;
+	job.j_sched = s;
+	s->active_thread->th_remote_pending++; /* the reaper keeps our stack until drained */
+
+	pthread_mutex_lock(&POOL.lock);
+	job.j_submit_ns = now_ns();
+	if (POOL.tail)
+		POOL.tail->j_next = &job;
+	else
+		POOL.head = &job;
+	POOL.tail = &job;
+	POOL.stats.submitted++;
+	if (++POOL.stats.queue_depth > POOL.stats.queue_max)
+		POOL.stats.queue_max = POOL.stats.queue_depth;
+	pthread_cond_signal(&POOL.cond);
+	pthread_mutex_unlock(&POOL.lock);
+
+	/* done is only set by this scheduler, so it cannot race the suspend */
+	while (!job.j_remote.done)
+		thread_suspend(NULL);
+
+	return job.j_result;
+}
+
+void thread_offload_stats(thread_offload_stats_t *stats)
+{
+	pthread_mutex_lock(&POOL.lock);
+	*stats = POOL.stats;
+	pthread_mutex_unlock(&POOL.lock);
+}
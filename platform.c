@@ -21,6 +21,9 @@ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
 OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE.
 */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE	/* register names in mcontext_t */
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -28,17 +31,6 @@ SOFTWARE.
 #include "platform.h"
 #include "thread.h"
 
-static thread_t *MAIN_THREAD;
-void
-platform_init_main_thread(
-	thread_t *main_thread
-)
-{
-	/* create main thread context */
-	MAIN_THREAD = main_thread;
-	memset(&main_thread->th_context, 0, sizeof(th_context_t));
-}
-
 void
 platform_context_switch(
 	thread_t *from_th,
@@ -48,6 +40,22 @@ platform_context_switch(
 	swapcontext(&from_th->th_context.p, &to_th->th_context.p);
 }
 
+static void
+platform_make_context(
+	thread_t *th,
+	int stacksize,
+	pfunc_t func
+)
+{
+	getcontext(&th->th_context.p);
+
+	th->th_context.p.uc_link = &thread_main()->th_context.p;
+	th->th_context.p.uc_stack.ss_sp = th->th_context.th_stack;
+	th->th_context.p.uc_stack.ss_size = stacksize;
+	th->th_context.th_stack_size = stacksize;
+	makecontext(&th->th_context.p, func, 0);
+}
+
 void
 platform_create_context(
 	thread_t *th,
@@ -61,12 +69,34 @@ platform_create_context(
 	assert(th->th_context.th_stack != 0);
 	bzero(th->th_context.th_stack, stacksize);
 
-	getcontext(&th->th_context.p);
+	platform_make_context(th, stacksize, func);
+}
 
-	th->th_context.p.uc_link = &MAIN_THREAD->th_context.p;
-	th->th_context.p.uc_stack.ss_sp = th->th_context.th_stack;
-	th->th_context.p.uc_stack.ss_size = stacksize;
-	makecontext(&th->th_context.p, func, 0);
+/*
+ * contexts for a whole batch in one pass; every stack is its own
+ * allocation so it goes away with its thread, all or nothing
+ */
+int
+platform_create_context_batch(
+	thread_t **ths,
+	int n,
+	int stacksize,
+	pfunc_t func
+)
+{
+	int i;
+
+	for (i=0; i<n; i++) {
+		memset(&ths[i]->th_context, 0, sizeof(th_context_t));
+		if ((ths[i]->th_context.th_stack = calloc(1, stacksize)) == NULL) {
+			while (i-- > 0)
+				platform_free_context(ths[i]);
+			return -1;
+		}
+		platform_make_context(ths[i], stacksize, func);
+	}
+
+	return 0;
 }
 
 void
@@ -75,5 +105,123 @@ platform_free_context(
 )
 {
 	free(th->th_context.th_stack);
+	th->th_context.th_stack = NULL;
 }
 
+/*
+ * walk the frame pointer chain of an interrupted context (the signal
+ * handler's ucontext); frames must stay inside the thread's stack, the
+ * main thread has no known bounds and is limited to 8MB above the first
+ * frame. Needs -fno-omit-frame-pointer, returns the number of pcs stored
+ */
+int
+platform_backtrace(
+	thread_t *th,
+	void *uctx,
+	void **pcs,
+	int max
+)
+{
+	ucontext_t *uc = (ucontext_t *)uctx;
+	uintptr_t pc, fp, lo, hi, next;
+	int n = 0;
+
+#if defined(__linux__) && defined(__x86_64__)
+	pc = (uintptr_t)uc->uc_mcontext.gregs[REG_RIP];
+	fp = (uintptr_t)uc->uc_mcontext.gregs[REG_RBP];
+#elif defined(__linux__) && defined(__aarch64__)
+	pc = (uintptr_t)uc->uc_mcontext.pc;
+	fp = (uintptr_t)uc->uc_mcontext.regs[29];
+#else
+	return 0; /* unsupported platform */
+#endif
+
+	if (th && th->th_context.th_stack) {
+		lo = (uintptr_t)th->th_context.th_stack;
+		hi = lo + th->th_context.th_stack_size;
+	} else {
+		lo = fp;
+		hi = fp + 8 * 1024 * 1024;
+	}
+
+	if (max > 0)
+		pcs[n++] = (void *)pc;
+
+	while (n < max) {
+		if (fp < lo || fp + 2 * sizeof(uintptr_t) > hi || (fp & (sizeof(uintptr_t) - 1)))
+			break;
+
+		next = ((uintptr_t *)fp)[0];
+		pc = ((uintptr_t *)fp)[1];
+		if (pc == 0)
+			break;
+
+		pcs[n++] = (void *)pc;
+		if (next <= fp)
+			break; /* frames must move up the stack */
+		fp = next;
+	}
+
+	return n;
+}
+
+/*
+ * stack high-water mark: stacks start zeroed and grow down, so the
+ * lowest non-zero word marks the deepest use; 0 for the main thread.
+ * Exact, but reads the whole unused part of the stack
+ */
+size_t
+platform_stack_used(
+	thread_t *th
+)
+{
+	uintptr_t *p = (uintptr_t *)th->th_context.th_stack;
+	uintptr_t *end;
+
+	if (p == NULL)
+		return 0;
+
+	end = (uintptr_t *)((char *)p + th->th_context.th_stack_size);
+	while (p < end && *p == 0)
+		p++;
+
+	th->th_context.th_stack_low = (char *)p - (char *)th->th_context.th_stack;
+	return (char *)end - (char *)p;
+}
+
+/*
+ * cheap high-water mark for periodic sampling: walk down from the last
+ * mark until a gap of PLATFORM_STACK_GAP zero bytes, so a stable stack
+ * costs one gap per look; a frame that skips over a whole gap of zeros
+ * is missed until the next platform_stack_used()
+ */
+#define PLATFORM_STACK_GAP	1024
+
+size_t
+platform_stack_watermark(
+	thread_t *th
+)
+{
+	char *base = (char *)th->th_context.th_stack;
+	uintptr_t *p, *low;
+	size_t zeros = 0;
+
+	if (base == NULL)
+		return 0;
+
+	if (th->th_context.th_stack_low == 0)
+		th->th_context.th_stack_low = th->th_context.th_stack_size;
+	low = (uintptr_t *)(base + th->th_context.th_stack_low);
+
+	for (p = low - 1; p >= (uintptr_t *)base && zeros < PLATFORM_STACK_GAP; p--) {
+		if (*p) {
+			low = p;
+			zeros = 0;
+		} else {
+			zeros += sizeof(*p);
+		}
+	}
+
+	th->th_context.th_stack_low = (char *)low - base;
+	return th->th_context.th_stack_size - th->th_context.th_stack_low;
+}
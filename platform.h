@@ -30,6 +30,8 @@ typedef struct th_context_t_
 {
 	ucontext_t p;
 	void *th_stack;
+	size_t th_stack_size;
+	size_t th_stack_low;	/* lowest used offset seen so far, 0 before the first look */
 } th_context_t;
 
 #endif /* __THREAD_PLATFORM_H_ */
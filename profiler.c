@@ -0,0 +1,192 @@
+/*
+MIT License
+
+Copyright (c) 2020 Kevin Huang
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE	/* dladdr */
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <dlfcn.h>
+#include "thread_internal.h"
+
+/*
+ * sampling profiler: SIGPROF records the active user thread of the
+ * interrupted scheduler and a frame pointer backtrace into a ring that
+ * is allocated up front, so the handler never allocates or locks
+ */
+#define PROF_MAX_DEPTH	32
+#define PROF_LINE_MAX	4096
+
+typedef struct _prof_sample {
+	thread_t	*th;
+	const char	*name;
+	int			depth;
+	void		*pc[PROF_MAX_DEPTH];
+} prof_sample_t;
+
+typedef struct _prof_state {
+	prof_sample_t	*ring;
+	int				size;
+	unsigned long	head;		/* samples taken, the ring keeps the last SIZE */
+	int				running;
+	struct sigaction old_action;
+} prof_state_t;
+
+static prof_state_t PROF;
+
+static void prof_handler(int sig, siginfo_t *info, void *uctx)
+{
+	th_system_t *s = THREAD;
+	prof_sample_t *sample;
+	thread_t *th;
+
+	if (s == NULL || PROF.ring == NULL)
+		return; /* not a scheduler thread */
+
+	th = s->active_thread;
+	sample = &PROF.ring[__atomic_fetch_add(&PROF.head, 1, __ATOMIC_RELAXED) % PROF.size];
+	sample->th = th;
+	sample->name = th->th_name ? th->th_name : "?";
+	sample->depth = platform_backtrace(th, uctx, sample->pc, PROF_MAX_DEPTH);
+}
+
+int thread_prof_start(int hz, int nsamples)
+{
+	struct sigaction sa;
+	struct itimerval it;
+
+	if (PROF.running || hz <= 0 || nsamples <= 0)
+		return -1;
+
+	free(PROF.ring);
+	PROF.ring = (prof_sample_t *)calloc(nsamples, sizeof(prof_sample_t));
+	if (PROF.ring == NULL)
+		return -1;
+	PROF.size = nsamples;
+	PROF.head = 0;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = prof_handler;
+	sa.sa_flags = SA_SIGINFO | SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGPROF, &sa, &PROF.old_action) < 0)
+		return -1;
+
+	it.it_interval.tv_sec = 0;
+	it.it_interval.tv_usec = hz >= 1000000 ? 1 : 1000000 / hz;
+	it.it_value = it.it_interval;
+	if (setitimer(ITIMER_PROF, &it, NULL) < 0) {
+		sigaction(SIGPROF, &PROF.old_action, NULL);
+		return -1;
+	}
+
+	PROF.running = 1;
+	return 0;
+}
+
+void thread_prof_stop(void)
+{
+	struct itimerval it;
+
+	if (!PROF.running)
+		return;
+
+	memset(&it, 0, sizeof(it));
+	setitimer(ITIMER_PROF, &it, NULL);
+	sigaction(SIGPROF, &PROF.old_action, NULL);
+	PROF.running = 0;
+}
+
+static int prof_frame(char *buf, int size, void *pc, int raw)
+{
+	Dl_info info;
+
+	if (!raw && dladdr(pc, &info) && info.dli_sname)
+		return snprintf(buf, size, ";%s", info.dli_sname);
+
+	return snprintf(buf, size, ";0x%lx", (unsigned long)(uintptr_t)pc);
+}
+
+static int prof_compare(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/*
+ * write "root;outer;...;inner count" lines; the root is the thread name,
+ * or name@slot with THREAD_PROF_BY_THREAD (a slot is reused by later
+ * threads). Symbols come from dladdr, link with -rdynamic to see the
+ * program's own functions. Stop the profiler before dumping
+ */
+int thread_prof_dump(FILE *fp, int flags)
+{
+	unsigned long taken = PROF.head;
+	int num = taken < (unsigned long)PROF.size ? (int)taken : PROF.size;
+	char **lines;
+	int i, j, len, count;
+
+	if (PROF.running || PROF.ring == NULL)
+		return -1;
+
+	if ((lines = (char **)calloc(num ? num : 1, sizeof(char *))) == NULL)
+		return -1;
+
+	for (i=0; i<num; i++) {
+		prof_sample_t *sample = &PROF.ring[i];
+
+		if ((lines[i] = (char *)malloc(PROF_LINE_MAX)) == NULL)
+			break;
+
+		if (flags & THREAD_PROF_BY_THREAD)
+			len = snprintf(lines[i], PROF_LINE_MAX, "%s@%p", sample->name, (void *)sample->th);
+		else
+			len = snprintf(lines[i], PROF_LINE_MAX, "%s", sample->name);
+
+		/* outermost frame first; return addresses point past the call */
+		for (j=sample->depth-1; j>=0 && len<PROF_LINE_MAX; j--) {
+			void *pc = j ? (char *)sample->pc[j] - 1 : sample->pc[j];
+			len += prof_frame(lines[i] + len, PROF_LINE_MAX - len, pc, flags & THREAD_PROF_RAW);
+		}
+	}
+	num = i;
+
+	qsort(lines, num, sizeof(char *), prof_compare);
+	for (i=0; i<num; i=j) {
+		for (j=i+1; j<num && strcmp(lines[i], lines[j])==0; j++)
+			;
+		count = j - i;
+		fprintf(fp, "%s %d\n", lines[i], count);
+	}
+
+	for (i=0; i<num; i++)
+		free(lines[i]);
+	free(lines);
+
+	if (taken > (unsigned long)PROF.size)
+		fprintf(stderr, "thread_prof_dump: ring overflow, kept %d of %lu samples\n",
+			PROF.size, taken);
+	return 0;
+}
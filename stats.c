@@ -0,0 +1,175 @@
+/*
+MIT License
+
+Copyright (c) 2020 Kevin Huang
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include "thread_internal.h"
+#include "ultstat.h"
+
+/*
+ * stats export: a periodic timer copies the scheduler counters into a
+ * shared file mapping under a seqlock, readers never touch the scheduler
+ */
+typedef struct _th_export {
+	char				*path;
+	int					fd;
+	ultstat_header_t	*map;
+	thread_timer_t		*timer;
+} th_export_t;
+
+static void stats_publish(th_system_t *s, ultstat_header_t *h)
+{
+	ultstat_thread_t *e;
+	struct timeval tv;
+	thread_t *th;
+	int i, n = 0;
+
+	__atomic_store_n(&h->seq, h->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	gettimeofday(&tv, NULL);
+	h->publish_ms = (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+	h->count = s->count;
+	h->ready_count = s->ready_count;
+	h->sleep_count = s->sleep_count;
+	h->switches = s->switches;
+	h->long_slices = s->long_slices;
+	h->ready_waits = s->ready_waits;
+	h->max_slice_ns = s->max_slice_ns;
+	h->max_wait_ns = s->max_wait_ns;
+
+	th = s->main_thread;
+	do {
+		if (n >= (int)h->max_threads)
+			break;
+		e = &h->thread[n++];
+		strncpy(e->name, th->th_name ? th->th_name : "?", ULTSTAT_NAME_LEN - 1);
+		e->name[ULTSTAT_NAME_LEN - 1] = 0;
+		e->slot = (uint32_t)(th - s->active_thread_slot);
+		e->state = th->th_state;
+		e->accum = th->th_accum;
+		for (i=0; i<ULTSTAT_NUM_STATE; i++)
+			e->accum_switch[i] = th->th_accumSwitch[i];
+		e->stack_size = th->th_context.th_stack_size;
+		/* cheap incremental mark for all, one exact scan per period */
+		if (e->slot == (uint32_t)s->export_rescan)
+			e->stack_used = platform_stack_used(th);
+		else
+			e->stack_used = platform_stack_watermark(th);
+		th = th->th_next;
+	} while (th != s->main_thread);
+	h->nthreads = n;
+	s->export_rescan = (s->export_rescan + 1) % MAX_THREAD;
+
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&h->seq, h->seq + 1, __ATOMIC_RELAXED);
+}
+
+static void stats_timer(thread_timer_t *timer, void *arg)
+{
+	th_system_t *s = (th_system_t *)arg;
+
+	stats_publish(s, s->export->map);
+}
+
+int thread_stats_export(const char *path, u_int period_ms)
+{
+	th_system_t *s;
+	th_export_t *ex;
+	ultstat_header_t *h;
+
+	if (!THREAD)
+		initial_thread_system();
+	s = THREAD;
+
+	if (s->export || period_ms == 0)
+		return -1;
+
+	if ((ex = (th_export_t *)calloc(1, sizeof(th_export_t))) == NULL)
+		return -1;
+	ex->fd = -1;
+	if ((ex->path = strdup(path)) == NULL)
+		goto fail;
+	if ((ex->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0)
+		goto fail;
+
+	if (ftruncate(ex->fd, ULTSTAT_SIZE(MAX_THREAD)) < 0)
+		goto fail;
+
+	h = (ultstat_header_t *)mmap(NULL, ULTSTAT_SIZE(MAX_THREAD),
+		PROT_READ | PROT_WRITE, MAP_SHARED, ex->fd, 0);
+	if (h == MAP_FAILED)
+		goto fail;
+	ex->map = h;
+
+	h->version = ULTSTAT_VERSION;
+	h->pid = getpid();
+	h->period_ms = period_ms;
+	h->max_threads = MAX_THREAD;
+	stats_publish(s, h);
+	__atomic_store_n(&h->magic, ULTSTAT_MAGIC, __ATOMIC_RELEASE); /* valid from here */
+
+	if ((ex->timer = thread_timer_add(period_ms, period_ms, stats_timer, s)) == NULL) {
+		munmap(h, ULTSTAT_SIZE(MAX_THREAD));
+		goto fail;
+	}
+
+	s->export = ex;
+	return 0;
+
+fail:
+	if (ex->fd >= 0) {
+		close(ex->fd);
+		unlink(path);
+	}
+	free(ex->path);
+	free(ex);
+	return -1;
+}
+
+void thread_stats_unexport(void)
+{
+	if (THREAD)
+		thread_stats_detach(THREAD);
+}
+
+void thread_stats_detach(th_system_t *s)
+{
+	th_export_t *ex = s->export;
+
+	if (ex == NULL)
+		return;
+
+	s->export = NULL;
+	thread_timer_cancel(ex->timer);
+	munmap(ex->map, ULTSTAT_SIZE(MAX_THREAD));
+	close(ex->fd);
+	unlink(ex->path);
+	free(ex->path);
+	free(ex);
+}
@@ -21,62 +21,149 @@ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
 OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE.
 */
-#include "thread.h"
+#include "thread_internal.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/time.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
 
-#define MAX_THREAD  256
-#define THREAD_SIGNATURE	0x82
+__thread th_system_t *THREAD;
 
-typedef struct _th_system_t {
-	thread_t *main_thread;
-	thread_t *active_thread;
-	thread_t active_thread_slot[MAX_THREAD];
-	thread_t *free_thread_list;
-	int count;
-	int ready_count;
-	int sleep_count;
-	uint64_t start;
-} th_system_t;
+/* fiber-local storage keys are shared by every scheduler */
+static int KEY_USED[THREAD_KEYS_MAX];
+static key_destructor_t KEY_DESTRUCTOR[THREAD_KEYS_MAX];
+static uint32_t KEY_GEN[THREAD_KEYS_MAX];	/* bumped on every create */
 
-static th_system_t THREAD;
-
-uint64_t tick_ms() {
+static uint64_t clock_ms() {
 	struct timeval  tv;
 	gettimeofday(&tv, NULL);
 
-	return (uint64_t)((tv.tv_sec) * 1000 + (tv.tv_usec) / 1000 - THREAD.start);
+	return (uint64_t)((tv.tv_sec) * 1000 + (tv.tv_usec) / 1000);
+}
+
+static uint64_t tick_ms(th_system_t *s) {
+	if (s->virtual_clock)
+		return s->vclock_ms;
+	return clock_ms() - s->start;
+}
+
+/* xorshift64*, the simulation's only source of scheduling order */
+static uint64_t sched_random(th_system_t *s) {
+	s->rng ^= s->rng >> 12;
+	s->rng ^= s->rng << 25;
+	s->rng ^= s->rng >> 27;
+	return s->rng * 0x2545F4914F6CDD1DULL;
 }
 
-static thread_t * ALLOC_THREAD_SLOT()
+uint64_t thread_tick_ms(th_system_t *s) {
+	return tick_ms(s);
+}
+
+static thread_t * ALLOC_THREAD_SLOT(th_system_t *s)
 {
-    thread_t *ret = THREAD.free_thread_list;
-    THREAD.free_thread_list = THREAD.free_thread_list->th_next;
+    thread_t *ret = s->free_thread_list;
+	if (ret == NULL)
+		return NULL; /* out of thread slots */
+    s->free_thread_list = s->free_thread_list->th_next;
 	
 	memset( ret, 0, sizeof( thread_t) );
+	ret->th_sched = s;
 
-	THREAD.count++;
+	s->count++;
     return ret;
 }
 
 static void free_thread_slot(
+	th_system_t *s,
 	thread_t *th)
 {
     memset( th, 0, sizeof( thread_t ) );
-	th->th_next = THREAD.free_thread_list;
-	THREAD.free_thread_list = th;
-	THREAD.count--;
+	th->th_next = s->free_thread_list;
+	s->free_thread_list = th;
+	s->count--;
+}
+
+
+static void thread_local_free(
+	thread_t *th)
+{
+	free( th->th_local_ext );
+	th->th_local_ext = NULL;
+}
+
+/* storage of KEY in TH, NULL when the overflow table is not there yet */
+static th_local_t *thread_local_slot(
+	thread_t *th,
+	int key)
+{
+	if (key < THREAD_KEYS_INLINE)
+		return &th->th_local[key];
+	if (th->th_local_ext == NULL)
+		return NULL;
+	return &th->th_local_ext[key - THREAD_KEYS_INLINE];
+}
+
+/*
+ * run the key destructors, normally on the terminating thread's own
+ * stack; values left over from a deleted key are dropped, not destroyed
+ */
+static void thread_local_destroy(
+	thread_t *th)
+{
+	int i, k, again;
+	th_local_t *slot;
+	void *value;
+
+	for (i=0; i<THREAD_DESTRUCTOR_ITERATIONS; i++) {
+		again = 0;
+		for (k=0; k<THREAD_KEYS_MAX; k++) {
+			if ((slot = thread_local_slot(th, k)) == NULL)
+				break;
+
+			value = slot->value;
+			slot->value = NULL;
+			if (slot->gen != __atomic_load_n(&KEY_GEN[k], __ATOMIC_ACQUIRE))
+				continue; /* stale, the key was deleted */
+
+			if (value && KEY_DESTRUCTOR[k]) {
+				KEY_DESTRUCTOR[k]( value );
+				again = 1;
+			}
+		}
+
+		if (!again)
+			break; /* destructors did not set new values */
+	}
 }
 
+static void thread_signal_free(
+	thread_t *th)
+{
+	th_system_t *s = th->th_sched;
+	th_sigqueue_t *q, *next;
+
+	for (q=th->th_sigq_head; q; q=next) {
+		next = q->next;
+		q->next = s->sigq_free;
+		s->sigq_free = q;
+	}
+	th->th_sigq_head = th->th_sigq_tail = NULL;
+
+	free( th->th_sighandler );
+	th->th_sighandler = NULL;
+}
 
 static void thread_free(
 	thread_t *th)
 {
     platform_free_context( th ); /* free thread stack */
-    free_thread_slot( th );
+	thread_signal_free( th );
+	thread_local_free( th );
+	thread_arena_release( th );
+    free_thread_slot( th->th_sched, th );
 }
 
 
@@ -90,19 +177,34 @@ static void thread_change_state(
 
 	/* chage the state of a given thread */
 	int old_state = th->th_state;
+	th_system_t *s = th->th_sched;
 	th->th_state = state;
 	if (old_state == THREAD_STATE_READY) {
 		if (state != THREAD_STATE_READY)
-			THREAD.ready_count--;
+			s->ready_count--;
 	} else if (state == THREAD_STATE_READY) {
-		THREAD.ready_count++;
+		s->ready_count++;
+		if (s->watchdog)
+			th->th_ready_ns = thread_now_ns();
 	}
 
 	if (old_state == THREAD_STATE_SLEEP) {
-		if (state != THREAD_STATE_SLEEP)
-			THREAD.sleep_count--;
+		if (state != THREAD_STATE_SLEEP) {
+			s->sleep_count--;
+			thread_deadline_remove(s, &th->th_wakeup);
+		}
 	} else if (state == THREAD_STATE_SLEEP) {
-		THREAD.sleep_count++;
+		s->sleep_count++;
+		thread_deadline_insert(s, &th->th_wakeup);
+	}
+
+	if (state == THREAD_STATE_TERMINATE && !th->th_reap_queued) {
+		/* freed later by the reaper, off the scheduling path; a thread
+		 * revived and terminated again is still queued from the first time */
+		th->th_reap_queued = 1;
+		th->th_reaplink = s->reap_list;
+		s->reap_list = th;
+		s->reap_count++;
 	}
 
 	th->th_accumSwitch[state]++;
@@ -113,62 +215,33 @@ static void thread_change_state(
 	}
 }
 
-static thread_t *pick_thread(thread_t *th, uint64_t now_ms)
+static thread_t *pick_thread(th_system_t *s, thread_t *th)
 {
     if (th) {
 		if (th->th_signature == THREAD_SIGNATURE) {
-			if (th->th_state == THREAD_STATE_SLEEP) {
-				if (now_ms >= th->expired_ms) {
-					thread_change_state( th, THREAD_STATE_READY, DO_ALERT );
-					th->expired_ms = 0; /* reset expired timer */
-				}
-			}
-
 			if ((th->th_state != THREAD_STATE_READY))
             	th = NULL;
 		} else {
 			printf("Fatal error: the thread is corrupted\n");
 			exit(1);
 		}
-    } else { /* if no thread is selected, choose a thread by scheduler (round-robin)*/
-		/* if the current thread is in sleeping, then check if it is expired or not */
-		th = THREAD.active_thread;
-		if (th->th_state == THREAD_STATE_SLEEP) {
-			if (now_ms >= th->expired_ms) {
-				/* wakeup switch state to ready */
-				thread_change_state( th, THREAD_STATE_READY, DO_ALERT );
-				th->expired_ms = 0; /* clear sleep timeout */
-				return th;
-			}
-		} 
-		th = THREAD.active_thread->th_next;
-		while (th!=THREAD.active_thread) {
-			switch (th->th_state) {
-				case THREAD_STATE_READY:
-					break;
-
-				case THREAD_STATE_SLEEP:
-					if (now_ms >= th->expired_ms) {
-						/* wakeup switch state to ready */
-						thread_change_state( th, THREAD_STATE_READY, DO_ALERT );
-						th->expired_ms = 0; /* clear sleep timeout */
-					}
-					break;
-
-				case THREAD_STATE_CLEAR: {
-					thread_t *new_th = th->th_next;
-					th->th_prev->th_next = th->th_next;
-					th->th_next->th_prev = th->th_prev;
-					thread_free( th );
-					th = new_th;
-					continue; /* continue the while loop */
-					}
-
-				case THREAD_STATE_TERMINATE:
-					thread_change_state( th, THREAD_STATE_CLEAR, DO_ALERT );
-					break;
-			} /* switch */
-
+    } else if (s->virtual_clock) { /* seeded uniform pick among the other READY threads */
+		int ready = 0, n;
+
+		for (th = s->active_thread->th_next; th != s->active_thread; th = th->th_next)
+			if (th->th_state == THREAD_STATE_READY)
+				ready++;
+		if (ready == 0)
+			return NULL;
+
+		n = (int)(sched_random(s) % ready);
+		for (th = s->active_thread->th_next; ; th = th->th_next)
+			if (th->th_state == THREAD_STATE_READY && n-- == 0)
+				break;
+	} else { /* if no thread is selected, choose a thread by scheduler (round-robin)*/
+		th = s->active_thread->th_next;
+		while (th!=s->active_thread) {
+			/* terminated threads wait for the reaper, skip them like the rest */
 			if (th->th_state==THREAD_STATE_READY)
 				break; /* break the while loop */
 
@@ -176,18 +249,60 @@ static thread_t *pick_thread(thread_t *th, uint64_t now_ms)
 		}
 
 		/* if pick an active thread, then select nothing */
-        if (th==THREAD.active_thread)
+        if (th==s->active_thread)
             th = NULL;
     }
 
     return th;
 }
 
+static void thread_signal_deliver(thread_t *th);
+
+/*
+ * free up to BUDGET terminated threads (all when BUDGET < 0); the
+ * running thread, and a thread whose stack another OS thread still
+ * holds (offload), are left for a later pass
+ */
+static int thread_reap_some(th_system_t *s, int budget)
+{
+	thread_t **pp = &s->reap_list, *th;
+	int freed = 0;
+
+	while ((th = *pp) != NULL && (budget < 0 || freed < budget)) {
+		if (th == s->active_thread || th->th_remote_pending) {
+			pp = &th->th_reaplink;
+			continue;
+		}
+
+		*pp = th->th_reaplink;
+		th->th_reap_queued = 0;
+		s->reap_count--;
+		if (th->th_state != THREAD_STATE_TERMINATE)
+			continue; /* revived, not ours any more */
+
+		thread_change_state( th, THREAD_STATE_CLEAR, DO_ALERT );
+		th->th_prev->th_next = th->th_next;
+		th->th_next->th_prev = th->th_prev;
+		thread_free( th );
+		freed++;
+	}
+
+	return freed;
+}
+
+int thread_reap(int budget)
+{
+	return THREAD ? thread_reap_some(THREAD, budget) : 0;
+}
+
 static void thread_stub()
 {
     thread_t *th = (thread_t *)thread_self();
 
+	if (th->th_signal & th->th_sighandled)
+		thread_signal_deliver( th ); /* signalled before it first ran */
     th->th_entry( th->th_param );
+	thread_local_destroy( th );
 	thread_change_state( th, THREAD_STATE_TERMINATE, DO_ALERT );
 
     // remove active thread, terminate the active thread
@@ -197,53 +312,159 @@ static void thread_stub()
 }
 
 
-void initial_thread_system()
+static void sched_init(th_system_t *s)
 {
 	int i;
 	thread_t *th;
-	memset( &THREAD, 0, sizeof(th_system_t));
-	THREAD.start = tick_ms();
+	memset( s, 0, sizeof(th_system_t));
+	s->start = clock_ms();
 
 	/* chain the free thread */
     for (i=0; i<MAX_THREAD-1; i++) {
-		THREAD.active_thread_slot[i].th_next = &THREAD.active_thread_slot[i+1];
+		s->active_thread_slot[i].th_next = &s->active_thread_slot[i+1];
     }
-    THREAD.active_thread_slot[i].th_next = NULL;
-    THREAD.free_thread_list = THREAD.active_thread_slot;
+    s->active_thread_slot[i].th_next = NULL;
+    s->free_thread_list = s->active_thread_slot;
 
-    th = ALLOC_THREAD_SLOT(); // initial main thread data structure
+    th = ALLOC_THREAD_SLOT(s); // initial main thread data structure
 
     th->th_next = th;
 	th->th_prev = th;
 
-	THREAD.active_thread = th;
-	THREAD.active_thread->th_signature = THREAD_SIGNATURE;
-	THREAD.active_thread->th_state = THREAD_STATE_READY;
-	THREAD.active_thread->th_name = "main thread";
-	THREAD.main_thread = THREAD.active_thread;
+	s->active_thread = th;
+	s->active_thread->th_signature = THREAD_SIGNATURE;
+	s->active_thread->th_state = THREAD_STATE_READY;
+	s->active_thread->th_name = "main thread";
+	s->main_thread = s->active_thread;
 	
-	THREAD.ready_count = 1; /* current thread */
+	s->ready_count = 1; /* current thread */
+	s->wake_fd[0] = s->wake_fd[1] = -1;
 }
 
+void initial_thread_system()
+{
+	if (THREAD != NULL)
+		return; /* already set up, possibly lazily; never wipe a live scheduler */
 
-thread_t * thread_create(
-	const char *name,
-	thread_func_t func,
-	void *param,
-	int stacksize)
+	THREAD = (th_system_t *)malloc(sizeof(th_system_t));
+	if (THREAD == NULL) {
+		printf("Fatal error: no memory for the thread system\n");
+		exit(1);
+	}
+	sched_init(THREAD);
+}
+
+int thread_sched_set_virtual_clock(int enable, uint64_t seed)
 {
-    thread_t *th;
+	th_system_t *s;
 
-    if (!THREAD.active_thread) { // initialize mapping thread management
+    if (!THREAD) {
         initial_thread_system();
     }
+	s = THREAD;
+
+	if (enable) {
+		/* start from the current tick so pending deadlines keep their meaning */
+		if (!s->virtual_clock)
+			s->vclock_ms = tick_ms(s);
+		s->rng = seed ? seed : 0x9E3779B97F4A7C15ULL; /* xorshift must not be zero */
+		s->virtual_clock = 1;
+	} else if (s->virtual_clock) {
+		/* carry on in real time from where the virtual clock stopped */
+		s->start = clock_ms() - s->vclock_ms;
+		s->virtual_clock = 0;
+	}
 
-    if ((th=ALLOC_THREAD_SLOT())==NULL)
-        return th;
+	return 0;
+}
 
-    if (stacksize < 128*KB)
-        stacksize = 128*KB;
+uint64_t thread_now_ms(void)
+{
+	return THREAD ? tick_ms(THREAD) : 0;
+}
 
+thread_sched_t *thread_sched_create(void)
+{
+	th_system_t *s = (th_system_t *)malloc(sizeof(th_system_t));
+
+	if (s == NULL)
+		return NULL;
+
+	/* the calling context becomes the main thread of the new scheduler */
+	sched_init(s);
+	return s;
+}
+
+int thread_sched_destroy(thread_sched_t *s)
+{
+	thread_t *th, *next;
+
+	if (s == NULL)
+		return -1;
+
+	/* only the main thread may tear its scheduler down */
+	if (s->active_thread != s->main_thread)
+		return -1;
+
+	/* an offload helper still holds a job on some stack, and the scheduler */
+	th = s->main_thread;
+	do {
+		if (th->th_remote_pending)
+			return -1;
+		th = th->th_next;
+	} while (th != s->main_thread);
+
+	th = s->main_thread->th_next;
+	while (th != s->main_thread) {
+		next = th->th_next;
+		platform_free_context( th );
+		thread_signal_free( th );
+		thread_local_free( th );
+		thread_arena_release( th );
+		th = next;
+	}
+	thread_signal_free( s->main_thread );
+	thread_local_free( s->main_thread );
+	thread_arena_release( s->main_thread );
+	thread_arena_cache_free( s );
+	thread_watchdog_detach( s );
+	thread_stats_detach( s );
+	thread_timer_free_all( s );
+	while (s->sigq_free) {
+		th_sigqueue_t *q = s->sigq_free;
+		s->sigq_free = q->next;
+		free(q);
+	}
+	if (s->wake_fd[0] >= 0) {
+		close(s->wake_fd[0]);
+		close(s->wake_fd[1]);
+	}
+
+	if (THREAD == s)
+		THREAD = NULL;
+	free(s);
+	return 0;
+}
+
+thread_sched_t *thread_sched_current(void)
+{
+	return THREAD;
+}
+
+thread_sched_t *thread_sched_set_current(thread_sched_t *s)
+{
+	thread_sched_t *old = THREAD;
+	THREAD = s;
+	return old;
+}
+
+
+static void thread_init_slot(
+	thread_t *th,
+	const char *name,
+	thread_func_t func,
+	void *param)
+{
 	th->th_name = name;
     th->th_entry = func;
     th->th_param = param;
@@ -255,21 +476,114 @@ thread_t * thread_create(
     th->th_errno = 0;
     th->th_suspcnt = 0;
     th->th_susplink = (thread_t *)NULL;
+}
+
+thread_t * thread_create(
+	const char *name,
+	thread_func_t func,
+	void *param,
+	int stacksize)
+{
+    thread_t *th;
+	th_system_t *s;
+
+    if (!THREAD) { // initialize mapping thread management
+        initial_thread_system();
+    }
+	s = THREAD;
+
+	if (s->free_thread_list == NULL)
+		thread_reap_some(s, -1); /* out of slots, collect the dead now */
+
+    if ((th=ALLOC_THREAD_SLOT(s))==NULL)
+        return th;
+
+    if (stacksize < 128*KB)
+        stacksize = 128*KB;
+
+	thread_init_slot(th, name, func, param);
 
 	/* create a platform dependent thread context */
 	platform_create_context(th, stacksize, thread_stub);
 
 	/* chain the thread structure */
-    th->th_next = THREAD.active_thread;
-    th->th_prev = THREAD.active_thread->th_prev;
-    THREAD.active_thread->th_prev = th;
+    th->th_next = s->active_thread;
+    th->th_prev = s->active_thread->th_prev;
+    s->active_thread->th_prev = th;
     th->th_prev->th_next = th;
-	THREAD.ready_count ++;
+	s->ready_count ++;
+	if (s->watchdog)
+		th->th_ready_ns = thread_now_ns();
 
     return th;
 }
 
 
+/*
+ * create N threads at once: slots and stacks are taken in one pass and
+ * the new threads are spliced into the ring in one step; each stack is
+ * still freed with its own thread;
+ * all or nothing, returns N or -1
+ */
+int thread_create_batch(
+	const char *name,
+	int n,
+	thread_func_t func,
+	void **params,
+	int stacksize,
+	thread_t **threads)
+{
+	thread_t *batch[MAX_THREAD];
+	thread_t *first, *last;
+	th_system_t *s;
+	int i;
+
+    if (!THREAD) {
+        initial_thread_system();
+    }
+	s = THREAD;
+
+	if (n <= 0)
+		return -1;
+	if (MAX_THREAD - s->count < n)
+		thread_reap_some(s, -1);
+	if (MAX_THREAD - s->count < n)
+		return -1; /* not enough slots */
+
+	if (stacksize < 128*KB)
+		stacksize = 128*KB;
+
+	for (i=0; i<n; i++) {
+		batch[i] = ALLOC_THREAD_SLOT(s);
+		thread_init_slot(batch[i], name, func, params ? params[i] : NULL);
+	}
+
+	if (platform_create_context_batch(batch, n, stacksize, thread_stub) < 0) {
+		for (i=0; i<n; i++)
+			free_thread_slot(s, batch[i]);
+		return -1;
+	}
+
+	/* chain the new threads together, then splice them in before the active one */
+	for (i=0; i<n; i++) {
+		batch[i]->th_prev = i ? batch[i-1] : NULL;
+		batch[i]->th_next = i < n-1 ? batch[i+1] : NULL;
+		if (s->watchdog)
+			batch[i]->th_ready_ns = thread_now_ns();
+		if (threads)
+			threads[i] = batch[i];
+	}
+	first = batch[0];
+	last = batch[n-1];
+	first->th_prev = s->active_thread->th_prev;
+	last->th_next = s->active_thread;
+	first->th_prev->th_next = first;
+	s->active_thread->th_prev = last;
+	s->ready_count += n;
+
+	return n;
+}
+
 int	thread_set_alert(
 	thread_t *th,
 	alert_func_t alert)
@@ -299,6 +613,8 @@ int thread_terminate(thread_t *th)
     if (th->th_signature!=THREAD_SIGNATURE)
         return -1;
 
+	/* its entry never returns, so destroy its keys here; a no-op once done */
+	thread_local_destroy( th );
 	thread_change_state(th, THREAD_STATE_TERMINATE, DO_ALERT);
     return 0;
 }
@@ -318,18 +634,19 @@ void thread_dump()
 	thread_t *thread_slot[MAX_THREAD];
 	char buf[256];
 	int i, num = 0;
+	th_system_t *s = THREAD;
 
-	thread_t *th = THREAD.active_thread;
+	thread_t *th = s->active_thread;
 	do {
 		thread_slot[num++] = th;
 		th = th->th_next;
-	} while (th != THREAD.active_thread);
+	} while (th != s->active_thread);
 
 	qsort(thread_slot, num, sizeof(thread_t *), thread_compare);
 
 	printf("---- thread information ----\n");
-	printf("thread ready count: %d\n", THREAD.ready_count);
-	printf("thread sleep count: %d\n", THREAD.sleep_count);
+	printf("thread ready count: %d\n", s->ready_count);
+	printf("thread sleep count: %d\n", s->sleep_count);
 
 	for (i=0; i<num; i++) {
 		sprintf(buf, "[%s]", thread_slot[i]->th_name);
@@ -348,71 +665,273 @@ void thread_dump()
 			thread_slot[i]->th_accumSwitch[THREAD_STATE_READY],
 			thread_slot[i]->th_accumSwitch[THREAD_STATE_SUSPEND],
 			thread_slot[i]->th_accumSwitch[THREAD_STATE_SLEEP],
-			thread_slot[i]->expired_ms);
+			thread_slot[i]->th_wakeup.expired_ms);
 
 		thread_slot[i]->th_accum = 0;
 	}
 	printf("---------------------------\n");
 }
 
+/* create the wakeup pipe, must run on the scheduler's own OS thread */
+int thread_remote_prepare(th_system_t *s)
+{
+	if (s->wake_fd[0] >= 0)
+		return 0;
+
+	if (pipe(s->wake_fd) < 0) {
+		s->wake_fd[0] = s->wake_fd[1] = -1;
+		return -1;
+	}
+	fcntl(s->wake_fd[0], F_SETFL, O_NONBLOCK);
+	fcntl(s->wake_fd[1], F_SETFL, O_NONBLOCK);
+	return 0;
+}
+
+/*
+ * callable from any OS thread, the node must stay valid until done is set;
+ * the owner must have counted the post in th_remote_pending beforehand
+ */
+void thread_remote_post(th_system_t *s, th_remote_t *r)
+{
+	th_remote_t *head = __atomic_load_n(&s->remote_head, __ATOMIC_RELAXED);
+
+	do {
+		r->next = head;
+	} while (!__atomic_compare_exchange_n(&s->remote_head, &head, r, 1,
+		__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	/* only the first wakeup of a batch needs to break the idle wait */
+	if (head == NULL && s->wake_fd[1] >= 0) {
+		char c = 0;
+		(void)!write(s->wake_fd[1], &c, 1); /* pipe full: a wakeup is pending anyway */
+	}
+}
+
+static void thread_remote_drain(th_system_t *s)
+{
+	th_remote_t *r, *next;
+	thread_t *th;
+	char buf[64];
+
+	/* empty the pipe first: a post landing after the swap keeps its byte */
+	while (read(s->wake_fd[0], buf, sizeof(buf)) > 0)
+		;
+	r = __atomic_exchange_n(&s->remote_head, NULL, __ATOMIC_ACQUIRE);
+
+	for (; r; r=next) {
+		/* the node may vanish once its thread runs again */
+		next = r->next;
+		th = r->th;
+		r->done = 1;
+		th->th_remote_pending--;
+		if (th->th_state != THREAD_STATE_TERMINATE)
+			thread_resume_force( th ); /* a terminated owner stays dead */
+	}
+}
+
+static void thread_idle(th_system_t *s, uint64_t now_ms)
+{
+	uint64_t next_ms = thread_get_min_expired(now_ms);
+
+	if (s->virtual_clock && next_ms != UINT64_MAX) {
+		/* nobody can run before the next deadline, skip straight to it */
+		if (next_ms > s->vclock_ms)
+			s->vclock_ms = next_ms;
+		return;
+	}
+	/* nothing to jump to (e.g. only offloaded work pending), really wait */
+
+	if (next_ms > now_ms + 10)
+		next_ms = now_ms + 10; /* 10ms at most */
+	if (next_ms <= now_ms)
+		return;
+
+	if (s->wake_fd[0] >= 0) {
+		struct pollfd pfd;
+		pfd.fd = s->wake_fd[0];
+		pfd.events = POLLIN;
+		poll(&pfd, 1, (int)(next_ms - now_ms));
+	} else {
+		usleep((next_ms - now_ms) * 1000);
+	}
+}
+
 thread_signal_t	thread_yield(thread_t *th)
 {
-	thread_t *cur_thread = thread_self();
+	th_system_t *s = THREAD;
+	thread_t *cur_thread = s->active_thread;
 	uint64_t now_ms;
 	
+	if (s->watchdog)
+		thread_watchdog_slice_end(s);
+
 	while (1) {
-		if (THREAD.ready_count == 0) {
-			/* there is no ready thread, host sleep for a while */
-			usleep(10000); /* 10ms */
+		now_ms = tick_ms(s);
+		thread_deadline_expire(s, now_ms); /* wake sleepers, fire timers */
+		if (__atomic_load_n(&s->remote_head, __ATOMIC_RELAXED))
+			thread_remote_drain(s);
+
+		if (s->ready_count == 0) {
+			/* there is no ready thread, reap the dead and sleep until the next deadline */
+			if (s->reap_list)
+				thread_reap_some(s, -1);
+			thread_idle(s, now_ms);
+			continue;
 		}
-		now_ms = tick_ms();
 
-    	if ((th = pick_thread(th, now_ms)) != NULL) {
-        	if (th == THREAD.active_thread)
+		/* never idle: keep the dead bounded, a few per pass */
+		if (s->reap_count > THREAD_REAP_HIGH_WATER)
+			thread_reap_some(s, THREAD_REAP_BUDGET);
+
+    	if ((th = pick_thread(s, th)) != NULL) {
+        	if (th == s->active_thread) {
+				if (s->watchdog)
+					thread_watchdog_slice_begin(s, th);
 				break; /* no other thread to yield to */
+			}
 
 			/*
 			 * switch context to DEST_THREAD 
 			 * context switch may jump to stub call, so we need set 
 			 * ACTIVE_THREAD here
 			 */
-			THREAD.active_thread = th;
+			s->switches++;
+			if (s->watchdog)
+				thread_watchdog_slice_begin(s, th);
+			s->active_thread = th;
         	platform_context_switch( cur_thread, th ); 
-			THREAD.active_thread = cur_thread;
+			s->active_thread = cur_thread;
 			break; /* return to destination thread */
     	} else {
 			/* no other thread to schedule to, so check the current active thread */
-			if (THREAD.active_thread->th_state == THREAD_STATE_READY) {
+			if (s->active_thread->th_state == THREAD_STATE_READY) {
+				if (s->watchdog)
+					thread_watchdog_slice_begin(s, cur_thread);
 				break; /* no other ready thread */
 			} else {
 				continue; /* check next time slot */
 			}
 		}
 	}
-	THREAD.active_thread->th_accum++;
-    return THREAD.active_thread->th_signal;
+	if (cur_thread->th_signal & cur_thread->th_sighandled)
+		thread_signal_deliver( cur_thread ); /* on our own stack */
+	s->active_thread->th_accum++;
+    return s->active_thread->th_signal;
+}
+
+/*
+ * directed handoff: switch straight to a known READY thread, skipping
+ * the scheduling pass, the clock and the deadline heap
+ */
+int thread_switch_to(thread_t *th)
+{
+	th_system_t *s = THREAD;
+	thread_t *cur_thread = s->active_thread;
+
+	if (th == NULL)
+		return -1;
+	if (th->th_signature != THREAD_SIGNATURE)
+		return -2;
+	if (th->th_sched != s)
+		return -1; /* owned by another scheduler */
+	if (th == cur_thread || th->th_state != THREAD_STATE_READY)
+		return -1;
+
+	s->switches++;
+	if (s->watchdog) {
+		thread_watchdog_slice_end(s);
+		thread_watchdog_slice_begin(s, th);
+	}
+	s->active_thread = th;
+	platform_context_switch( cur_thread, th );
+	s->active_thread = cur_thread;
+	if (cur_thread->th_signal & cur_thread->th_sighandled)
+		thread_signal_deliver( cur_thread );
+	return 0;
+}
+
+/*
+ * park FROM and run TO in its place; the states are swapped without
+ * alerts and the ready count does not change
+ */
+void thread_handoff(thread_t *from, thread_t *to)
+{
+	th_system_t *s = from->th_sched;
+
+	from->th_state = THREAD_STATE_SUSPEND;
+	to->th_state = THREAD_STATE_READY;
+
+	s->switches++;
+	if (s->watchdog) {
+		thread_watchdog_slice_end(s);
+		to->th_ready_ns = 0; /* handed over, it never waited */
+		thread_watchdog_slice_begin(s, to);
+	}
+	s->active_thread = to;
+	platform_context_switch( from, to );
+	s->active_thread = from;
+	if (from->th_signal & from->th_sighandled)
+		thread_signal_deliver( from );
 }
 
 thread_t * thread_self(void)
 {
-	return THREAD.active_thread;;
+	return THREAD ? THREAD->active_thread : NULL;
+}
+
+uint64_t thread_get_min_expired(uint64_t now_tick)
+{
+	th_system_t *s = THREAD;
+
+	if (s->heap_count == 0)
+		return UINT64_MAX; /* nothing is waiting */
+
+	return s->heap[1]->expired_ms;
+}
+
+void thread_get_stats(thread_stats_t *stats)
+{
+	th_system_t *s = THREAD;
+
+	memset(stats, 0, sizeof(thread_stats_t));
+	if (s == NULL)
+		return;
+
+	stats->count = s->count;
+	stats->ready_count = s->ready_count;
+	stats->sleep_count = s->sleep_count;
+	stats->switches = s->switches;
+	stats->long_slices = s->long_slices;
+	stats->ready_waits = s->ready_waits;
+	stats->max_slice_ns = s->max_slice_ns;
+	stats->max_wait_ns = s->max_wait_ns;
+}
+
+thread_t * thread_main(void)
+{
+	return THREAD ? THREAD->main_thread : NULL;
+}
+
+int thread_total(void)
+{
+	return THREAD ? THREAD->count : 0;
 }
 
 
 int thread_suspend(thread_t *th)
 {
 	if (!th)
-		th = THREAD.active_thread;;
+		th = THREAD->active_thread;
 
 	if (th->th_signature!=THREAD_SIGNATURE)
 		return -1; // fail
 
 	if (++th->th_suspcnt>0) {
 		thread_change_state( th, THREAD_STATE_SUSPEND, DO_ALERT );
-		th->expired_ms = 0; /* clear the expired time out */
+		th->th_wakeup.expired_ms = 0; /* clear the expired time out */
 	}
 
-	if (th==THREAD.active_thread) {
+	if (th==th->th_sched->active_thread) {
 		thread_yield( NULL );
 	}
 
@@ -427,7 +946,7 @@ int thread_resume(thread_t *th)
 	if (--th->th_suspcnt<=0) { 
 		thread_change_state(th, THREAD_STATE_READY, DO_ALERT);
 		th->th_suspcnt = 0;
-		th->expired_ms = 0; /* clear the expired time out */
+		th->th_wakeup.expired_ms = 0; /* clear the expired time out */
 	}
 
 	return 0;
@@ -442,7 +961,7 @@ int thread_resume_force(thread_t *th)
 	if (th->th_state != THREAD_STATE_READY)
 		thread_change_state( th, THREAD_STATE_READY, DO_ALERT);
 		
-	th->expired_ms = 0; /* clear the expired time out */
+	th->th_wakeup.expired_ms = 0; /* clear the expired time out */
 
 	return 0;
 }
@@ -456,7 +975,7 @@ int thread_resume_from_interrupt(thread_t *th)
 	if (th->th_state != THREAD_STATE_READY)
 		thread_change_state( th, THREAD_STATE_READY, NO_ALERT);
 		
-	th->expired_ms = 0; /* clear the expired time out */
+	th->th_wakeup.expired_ms = 0; /* clear the expired time out */
 
 	return 0;
 
@@ -465,9 +984,9 @@ int thread_resume_from_interrupt(thread_t *th)
 int thread_sleep(u_int msecs)
 {
 	thread_signal_t	sig;
-	thread_t *th = THREAD.active_thread;
+	thread_t *th = THREAD->active_thread;
 
-	th->expired_ms = msecs + tick_ms();
+	th->th_wakeup.expired_ms = msecs + tick_ms(THREAD);
 	thread_change_state(th, THREAD_STATE_SLEEP, DO_ALERT);
 
 	return thread_yield(NULL); /* yield to other thread */
@@ -484,7 +1003,7 @@ int thread_wake_up(thread_t *th)
 
 	if (th->th_state==THREAD_STATE_SLEEP) {
 		thread_change_state(th, THREAD_STATE_READY, DO_ALERT);
-		th->expired_ms = 0;
+		th->th_wakeup.expired_ms = 0;
 		return 0;
 	}
 
@@ -495,11 +1014,13 @@ int thread_wake_up(thread_t *th)
 int thread_kill(thread_t *th, thread_signal_t event)
 {
     if (th&&th->th_signature==THREAD_SIGNATURE) {
-        th->th_signal = event;
+        th->th_signal |= event; /* accumulate, nothing is lost */
 		if (th->th_state==THREAD_STATE_SLEEP) { 
 			/* WAKE UP !! */
 			thread_change_state(th, THREAD_STATE_READY, DO_ALERT);
-			th->expired_ms = 0;
+			th->th_wakeup.expired_ms = 0;
+		} else if (th->th_sigwait & event) {
+			thread_resume_force(th); /* blocked in thread_sigwait() */
 		}
 
 		if (th->th_kill_alert)
@@ -509,18 +1030,223 @@ int thread_kill(thread_t *th, thread_signal_t event)
     return 0;
 }
 
+/* queue one payload with a single signal bit, then signal as thread_kill() */
+int thread_sigqueue(thread_t *th, thread_signal_t sig, void *payload)
+{
+	th_system_t *s;
+	th_sigqueue_t *q;
+
+	if (th==NULL || th->th_signature!=THREAD_SIGNATURE)
+		return -1;
+
+	if (sig == 0 || (sig & (sig - 1)))
+		return -1; /* exactly one signal */
+
+	s = th->th_sched;
+	if ((q = s->sigq_free) != NULL)
+		s->sigq_free = q->next;
+	else if ((q = (th_sigqueue_t *)malloc(sizeof(th_sigqueue_t))) == NULL)
+		return -1;
+
+	q->next = NULL;
+	q->sig = sig;
+	q->payload = payload;
+	if (th->th_sigq_tail)
+		th->th_sigq_tail->next = q;
+	else
+		th->th_sigq_head = q;
+	th->th_sigq_tail = q;
+
+	return thread_kill(th, sig);
+}
+
+/* take the oldest payload of SIG, the bit stays set while more are queued */
+static int thread_sigq_take(thread_t *th, thread_signal_t sig, void **payload)
+{
+	th_sigqueue_t **pp, *q, *found = NULL;
+	int more = 0;
+
+	for (pp=&th->th_sigq_head; (q = *pp) != NULL; ) {
+		if (q->sig != sig) {
+			pp = &q->next;
+			continue;
+		}
+		if (found) {
+			more = 1;
+			break;
+		}
+		found = q;
+		*pp = q->next; /* unlink, PP now points at the next entry */
+	}
+
+	if (found && th->th_sigq_tail == found) {
+		/* removed the last entry, find the new tail */
+		th->th_sigq_tail = NULL;
+		for (q=th->th_sigq_head; q; q=q->next)
+			th->th_sigq_tail = q;
+	}
+
+	if (!more)
+		th->th_signal &= ~sig;
+
+	if (found == NULL) {
+		*payload = NULL;
+		return 0;
+	}
+
+	*payload = found->payload;
+	found->next = th->th_sched->sigq_free;
+	th->th_sched->sigq_free = found;
+	return 1;
+}
+
+/* run the handlers of the pending signals, lowest bit first */
+static void thread_signal_deliver(thread_t *th)
+{
+	thread_signal_t pending, sig;
+	void *payload;
+
+	while ((pending = th->th_signal & th->th_sighandled) != 0) {
+		sig = pending & (~pending + 1);
+		thread_sigq_take(th, sig, &payload);
+		th->th_sighandler[__builtin_ctz(sig)]( sig, payload );
+	}
+}
+
+int thread_set_signal_handler(thread_t *th, thread_signal_t sigs, signal_func_t handler)
+{
+	int i;
+
+	if (th == NULL)
+		th = THREAD->active_thread;
+	if (th->th_signature!=THREAD_SIGNATURE)
+		return -1;
+
+	if (th->th_sighandler == NULL) {
+		th->th_sighandler = (signal_func_t *)calloc(32, sizeof(signal_func_t));
+		if (th->th_sighandler == NULL)
+			return -1;
+	}
+
+	for (i=0; i<32; i++) {
+		if (!(sigs & (1u << i)))
+			continue;
+		th->th_sighandler[i] = handler;
+		if (handler)
+			th->th_sighandled |= 1u << i;
+		else
+			th->th_sighandled &= ~(1u << i);
+	}
+
+	return 0;
+}
+
+/* block until a signal in SET arrives, returns it with its payload if any */
+thread_signal_t thread_sigwait(thread_signal_t set, void **payload)
+{
+	thread_t *th = THREAD->active_thread;
+	thread_signal_t sig;
+	void *p;
+
+	while (!(th->th_signal & set)) {
+		th->th_sigwait = set;
+		thread_suspend( NULL );
+	}
+	th->th_sigwait = 0;
+
+	sig = th->th_signal & set;
+	sig &= ~sig + 1;
+	thread_sigq_take(th, sig, &p);
+	if (payload)
+		*payload = p;
+
+	return sig;
+}
+
 thread_signal_t thread_poll_signal(void)
 {
-    return THREAD.active_thread->th_signal;
+    return THREAD->active_thread->th_signal;
 }
 
 
 void thread_reset_signal(void)
 {
-    THREAD.active_thread->th_signal = 0;
+	thread_t *th = THREAD->active_thread;
+	th_sigqueue_t *q;
+
+    th->th_signal = 0;
+	while ((q = th->th_sigq_head) != NULL) {
+		/* drop the queued payloads too */
+		th->th_sigq_head = q->next;
+		q->next = th->th_sched->sigq_free;
+		th->th_sched->sigq_free = q;
+	}
+	th->th_sigq_tail = NULL;
+}
+
+int thread_key_create(thread_key_t *key, key_destructor_t destructor)
+{
+	int i;
+
+	for (i=0; i<THREAD_KEYS_MAX; i++) {
+		if (__sync_bool_compare_and_swap(&KEY_USED[i], 0, 1)) {
+			KEY_DESTRUCTOR[i] = destructor;
+			__atomic_add_fetch(&KEY_GEN[i], 1, __ATOMIC_RELEASE); /* old values go stale */
+			*key = i;
+			return 0;
+		}
+	}
+
+	return -1; /* no more keys */
+}
+
+/* values still held by threads are not destroyed, they just read NULL */
+int thread_key_delete(thread_key_t key)
+{
+	if ((unsigned)key >= THREAD_KEYS_MAX || !KEY_USED[key])
+		return -1;
+
+	KEY_DESTRUCTOR[key] = NULL;
+	__sync_lock_release(&KEY_USED[key]);
+	return 0;
+}
+
+void *thread_getspecific(thread_key_t key)
+{
+	th_local_t *slot;
+
+	if ((unsigned)key >= THREAD_KEYS_MAX ||
+		(slot = thread_local_slot(THREAD->active_thread, key)) == NULL)
+		return NULL;
+
+	if (slot->gen != __atomic_load_n(&KEY_GEN[key], __ATOMIC_ACQUIRE))
+		return NULL; /* left over from a deleted key */
+
+	return slot->value;
+}
+
+int thread_setspecific(thread_key_t key, const void *value)
+{
+	thread_t *th = THREAD->active_thread;
+	th_local_t *slot;
+
+	if ((unsigned)key >= THREAD_KEYS_MAX)
+		return -1;
+
+	if (key >= THREAD_KEYS_INLINE && th->th_local_ext == NULL) {
+		/* first key past the inline slots, allocate the overflow table */
+		th->th_local_ext = (th_local_t *)calloc(THREAD_KEYS_MAX - THREAD_KEYS_INLINE, sizeof(th_local_t));
+		if (th->th_local_ext == NULL)
+			return -1;
+	}
+
+	slot = thread_local_slot(th, key);
+	slot->value = (void *)value;
+	slot->gen = __atomic_load_n(&KEY_GEN[key], __ATOMIC_ACQUIRE);
+	return 0;
 }
 
 int thread_errno()
 {
-	return THREAD.active_thread->th_errno;
+	return THREAD->active_thread->th_errno;
 }
@@ -24,7 +24,9 @@ SOFTWARE.
 #ifndef _THREAD_H_
 #define _THREAD_H_
 
+#include <stdio.h>
 #include <stdint.h>
+#include <stddef.h>
 #include "platform.h"
 
 #ifdef __cplusplus
@@ -41,6 +43,29 @@ extern "C" {
 
 #define THREAD_DEFAULT_STACK_SIZE   (64 * KB)
 
+/* fiber-local storage: the first keys live inline in thread_t */
+#define THREAD_KEYS_INLINE			8
+#define THREAD_KEYS_MAX				128
+#define THREAD_DESTRUCTOR_ITERATIONS	4
+
+/* thread_alloc() arena chunk, larger requests get a chunk of their own */
+#define THREAD_ARENA_CHUNK_SIZE		(16 * KB)
+
+/* helper pthreads started by the first thread_offload() */
+#define THREAD_OFFLOAD_DEFAULT_THREADS	4
+#define THREAD_OFFLOAD_MAX_THREADS		64
+
+/* per-thread storage for a small entry argument, e.g. a C++ closure */
+#define THREAD_INLINE_ARG_SIZE		64
+
+/* reaper: a scheduler that never idles frees this many dead threads
+ * per pass once more than THREAD_REAP_HIGH_WATER are waiting */
+#define THREAD_REAP_HIGH_WATER		32
+#define THREAD_REAP_BUDGET			8
+
+/* frames kept for a watchdog report */
+#define THREAD_WD_MAX_DEPTH			16
+
 enum {
     THREAD_STATE_READY = 0,
     THREAD_STATE_SUSPEND,
@@ -55,6 +80,7 @@ enum {
 
 /* forward references */
 struct _thread;
+struct _th_system_t;
 
 /* required type definitions */
 /* thread entry function */
@@ -65,10 +91,95 @@ typedef void (*alert_func_t) (struct _thread *th, int old_state, int new_state);
 typedef void (*kill_alert_func_t)(struct _thread *caller, 
 	struct _thread *callee, int signal);
 
+/* per-thread bump allocator, released as a whole */
+typedef struct _th_arena_chunk th_arena_chunk_t;
+typedef struct _th_arena {
+	th_arena_chunk_t	*ar_chunks;	/* most recent chunk first */
+	char				*ar_ptr;
+	char				*ar_end;
+} th_arena_t;
+
+/* entry of the scheduler deadline heap, shared by sleeping threads and timers */
+typedef struct _th_deadline {
+	uint64_t	expired_ms;
+	int			dl_index;	/* 1-based heap position, 0 when not queued */
+	int			dl_kind;
+} th_deadline_t;
+
+/* timer callback, runs on the scheduler and must not block or yield */
+typedef struct _thread_timer thread_timer_t;
+typedef void (*timer_func_t)(thread_timer_t *timer, void *arg);
+
+/* generator, a thread that hands values to its consumer */
+typedef struct _thread_gen thread_gen_t;
+
+/* call run on the offload pool, and the pool counters */
+typedef void *(*offload_func_t)(void *arg);
+typedef struct _thread_offload_stats {
+	int			threads;		/* helper pthreads */
+	int			busy;			/* helpers running a call */
+	int			queue_depth;	/* calls waiting for a helper */
+	int			queue_max;		/* deepest queue seen */
+	uint64_t	submitted;
+	uint64_t	completed;
+	uint64_t	wait_ns_total;	/* time queued before a helper took the call */
+	uint64_t	wait_ns_max;
+	uint64_t	run_ns_total;	/* time spent in the calls */
+} thread_offload_stats_t;
+
+/* scheduler counters of the calling OS thread */
+typedef struct _thread_stats {
+	int			count;
+	int			ready_count;
+	int			sleep_count;
+	uint64_t	switches;
+	uint64_t	long_slices;	/* watchdog: slices over the threshold */
+	uint64_t	ready_waits;	/* watchdog: ready waits over the threshold */
+	uint64_t	max_slice_ns;
+	uint64_t	max_wait_ns;
+} thread_stats_t;
+
+/*
+ * watchdog report, runs on the scheduler when the slice ends; a slice
+ * still running past the threshold is reported once beforehand from the
+ * watcher pthread, so the report function must be thread-safe
+ */
+enum {
+	THREAD_WD_LONG_SLICE = 0,	/* ran too long without yielding */
+	THREAD_WD_READY_WAIT,		/* was READY too long before running */
+	THREAD_WD_STALLED			/* still running past the threshold, from the watcher */
+};
+
+typedef struct _thread_watchdog_event {
+	int			kind;
+	struct _thread *th;
+	const char	*name;
+	uint64_t	duration_ns;
+	int			depth;		/* backtrace taken while the slice still ran */
+	void		*pc[THREAD_WD_MAX_DEPTH];
+} thread_watchdog_event_t;
+
+typedef void (*watchdog_func_t)(const thread_watchdog_event_t *event);
+
+/* fiber-local storage key and its destructor */
+typedef int		thread_key_t;
+typedef void (*key_destructor_t)(void *value);
+
+/* a value counts only while its generation matches the key's, so a
+ * deleted and reused key reads NULL everywhere */
+typedef struct _th_local {
+	void		*value;
+	uint32_t	gen;
+} th_local_t;
+
 /* signal to thread */
 typedef unsigned int	thread_signal_t;
 typedef unsigned int	u_int;
 
+/* signal handler, runs on the target thread's stack once it is switched in */
+typedef void (*signal_func_t)(thread_signal_t sig, void *payload);
+typedef struct _th_sigqueue th_sigqueue_t;
+
 /*
  * user-defined thread abstractions
  */
@@ -80,6 +191,11 @@ struct _thread {
     /* entry */
     thread_func_t	th_entry;
     void			*th_param;
+	union {
+		void		*p;
+		long double	ld;		/* for alignment */
+		char		bytes[THREAD_INLINE_ARG_SIZE];
+	} th_inline;			/* th_param may point here */
 	
 	/* alert function */
 	alert_func_t		th_alert;
@@ -87,32 +203,59 @@ struct _thread {
 
     /* relationship */
     struct _thread  *th_parent;
+	struct _th_system_t *th_sched;	/* owning scheduler */
 
     /* ipc */
     int				th_errno;
-    thread_signal_t th_signal;
+    thread_signal_t th_signal;		/* pending signal mask */
+	thread_signal_t	th_sighandled;	/* signals with a handler */
+	thread_signal_t	th_sigwait;		/* signals thread_sigwait() is blocked on */
+	signal_func_t	*th_sighandler;	/* one per signal bit, allocated on first use */
+	th_sigqueue_t	*th_sigq_head;	/* queued payloads, oldest first */
+	th_sigqueue_t	*th_sigq_tail;
+
+	/* fiber-local storage, keys past THREAD_KEYS_INLINE go to th_local_ext */
+	th_local_t	th_local[THREAD_KEYS_INLINE];
+	th_local_t	*th_local_ext;
+
+	/* arena for thread_alloc() */
+	th_arena_t	th_arena;
 
     /* management */
     u_int       th_suspcnt;
-	uint64_t	expired_ms; 
+	union {
+		th_deadline_t	th_wakeup;	/* sleep timeout */
+		uint64_t		expired_ms;	/* old name of th_wakeup.expired_ms */
+	};
 
     /* signature */
     uint32_t   th_signature;
 
     /* thread state */
     u_int       th_state;
+	uint64_t	th_ready_ns;	/* became READY, set while the watchdog runs */
 	uint32_t 	th_accum;
 	uint32_t	th_accumSwitch[THREAD_NUM_STATE];
 
     
     /* for memory allocate fail*/
     struct _thread	   *th_susplink;    
+	struct _thread		*th_reaplink;	/* reaper list */
+	int					th_reap_queued;	/* on the reaper list */
+	int					th_remote_pending;	/* remote posts in flight, they point into the stack */
     
     struct _thread		*th_prev;
     struct _thread		*th_next;
 };
 
 typedef struct _thread thread_t;
+
+/*
+ * scheduler instance; every OS thread has its own current scheduler and
+ * all thread_* calls act on it, so schedulers on different OS threads
+ * share nothing and need no locks
+ */
+typedef struct _th_system_t thread_sched_t;
 /*
  * thread signal for the field "th_signal"
  */
@@ -155,11 +298,29 @@ typedef struct _thread thread_t;
 #define thread_is_suspended(th)	    ((th)->th_suspcnt >= 1)
 #define thread_is_ready(th)	    ((th)->th_suspcnt == 0)
 
+/*
+ * scheduler instances
+ */
+thread_sched_t	*thread_sched_create(void);
+int				thread_sched_destroy(thread_sched_t *sched); /* -1 while offloads are in flight */
+thread_sched_t	*thread_sched_current(void);
+thread_sched_t	*thread_sched_set_current(thread_sched_t *sched);
+
+/*
+ * virtual clock: the scheduler's time jumps to the next deadline instead
+ * of sleeping and READY threads are picked in a seeded random order, so
+ * a timer-heavy run is fast and replays exactly for the same seed
+ */
+int				thread_sched_set_virtual_clock(int enable, uint64_t seed);
+uint64_t		thread_now_ms(void);
+
 /*
  * basic
  */
 void			initial_thread_system();
 thread_t		*thread_create(const char *name, thread_func_t func, void *param, int stacksize);
+int				thread_create_batch(const char *name, int n, thread_func_t func, void **params, int stacksize, thread_t **threads);
+int				thread_reap(int budget);
 int				thread_set_alert(thread_t *th, alert_func_t alert);
 int 			thread_set_kill_alert(thread_t *th, kill_alert_func_t alert);
 alert_func_t	thread_get_alert(thread_t *th);
@@ -171,6 +332,16 @@ int				thread_suspend(thread_t *th);
 int				thread_resume(thread_t *th);
 uint64_t		thread_get_min_expired(uint64_t now_tick);
 
+/* directed handoff to a READY thread, no scheduling pass */
+int				thread_switch_to(thread_t *th);
+
+/* generators */
+thread_gen_t	*thread_gen_create(const char *name, thread_func_t func, void *param, int stacksize);
+void			*thread_gen_next(thread_gen_t *gen);
+int				thread_gen_yield(void *value);
+int				thread_gen_done(thread_gen_t *gen);
+void			thread_gen_free(thread_gen_t *gen);
+
 /* alternative suspend, resume. */
 int				thread_resume_force(thread_t *th);
 
@@ -178,11 +349,56 @@ int				thread_resume_force(thread_t *th);
 int				thread_sleep(u_int msecs);
 int				thread_wake_up(thread_t *th); /* wake up the thread */
 
+/*
+ * timers, period_ms 0 fires once; a handle is dead once it is canceled
+ * or its one-shot has fired, do not pass it to cancel or reschedule again
+ */
+thread_timer_t	*thread_timer_add(u_int delay_ms, u_int period_ms, timer_func_t func, void *arg);
+int				thread_timer_cancel(thread_timer_t *timer);
+int				thread_timer_reschedule(thread_timer_t *timer, u_int delay_ms, u_int period_ms);
+
+/* blocking calls on helper pthreads, only the calling thread waits */
+int				thread_offload_init(int nthreads);
+void			*thread_offload(offload_func_t func, void *arg);
+void			thread_offload_stats(thread_offload_stats_t *stats);
+
+/* sampling profiler, folded stacks for flamegraph tools */
+#define THREAD_PROF_BY_THREAD	0x1	/* one root per user thread, not per name */
+#define THREAD_PROF_RAW			0x2	/* hex addresses, symbolize offline */
+int				thread_prof_start(int hz, int nsamples);
+void			thread_prof_stop(void);
+int				thread_prof_dump(FILE *fp, int flags);
+
+/* watchdog for long slices and ready waits, 0 disables a threshold */
+int				thread_watchdog_start(u_int slice_ms, u_int wait_ms, watchdog_func_t report);
+void			thread_watchdog_stop(void);
+void			thread_get_stats(thread_stats_t *stats);
+
+/* publish the stats to a memory-mapped file for ultop */
+int				thread_stats_export(const char *path, u_int period_ms);
+void			thread_stats_unexport(void);
+
 /* signal */
 int				thread_kill(thread_t *th, thread_signal_t event);
+int				thread_sigqueue(thread_t *th, thread_signal_t sig, void *payload);
+int				thread_set_signal_handler(thread_t *th, thread_signal_t sigs, signal_func_t handler);
+thread_signal_t	thread_sigwait(thread_signal_t set, void **payload);
 thread_signal_t thread_poll_signal(void);
 void			thread_reset_signal(void);
 
+/*
+ * fiber-local storage; destructors run when the entry function returns,
+ * or on the caller's stack when the thread is stopped by thread_terminate()
+ */
+int				thread_key_create(thread_key_t *key, key_destructor_t destructor);
+int				thread_key_delete(thread_key_t key);
+void			*thread_getspecific(thread_key_t key);
+int				thread_setspecific(thread_key_t key, const void *value);
+
+/* arena allocation, freed when the thread terminates */
+void			*thread_alloc(size_t size);
+void			thread_arena_reset(void);
+
 /* errno of the current thread */
 int				thread_errno(void);
 
@@ -198,7 +414,11 @@ thread_t *thread_main(void);
 typedef void (*pfunc_t)();
 void platform_context_switch(thread_t *from_th, thread_t *to_th);     
 void platform_create_context(thread_t *th, int stacksize, pfunc_t f);
+int  platform_create_context_batch(thread_t **ths, int n, int stacksize, pfunc_t f);
 void platform_free_context(thread_t *th);
+int  platform_backtrace(thread_t *th, void *ucontext, void **pcs, int max);
+size_t platform_stack_used(thread_t *th);
+size_t platform_stack_watermark(thread_t *th);
 
 #ifdef __cplusplus
 }
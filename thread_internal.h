@@ -0,0 +1,158 @@
+/*
+MIT License
+
+Copyright (c) 2020 Kevin Huang
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#ifndef _THREAD_INTERNAL_H_
+#define _THREAD_INTERNAL_H_
+
+/*
+ * scheduler internals shared by the thread system modules,
+ * not part of the public API
+ */
+
+#include <pthread.h>
+#include "thread.h"
+
+#define MAX_THREAD  256
+#define THREAD_SIGNATURE	0x82
+
+/* spare arena chunks kept per scheduler */
+#define THREAD_ARENA_CACHE_MAX	64
+
+/* th_deadline_t kinds */
+#define DEADLINE_THREAD		0
+#define DEADLINE_TIMER		1
+
+struct _th_arena_chunk {
+	struct _th_arena_chunk *next;
+	size_t size;	/* usable bytes after the header */
+};
+
+/* signal payload queued on a thread */
+struct _th_sigqueue {
+	struct _th_sigqueue *next;
+	thread_signal_t sig;
+	void *payload;
+};
+
+/* wakeup posted to a scheduler from another OS thread */
+typedef struct _th_remote {
+	struct _th_remote *next;
+	thread_t *th;			/* resumed by the owning scheduler */
+	volatile int done;		/* set by the owning scheduler */
+} th_remote_t;
+
+/* watchdog of one scheduler, the slice fields are read by the watcher pthread */
+typedef struct _th_watchdog {
+	uint64_t		slice_ns;		/* report slices longer than this */
+	uint64_t		wait_ns;		/* report ready waits longer than this */
+	watchdog_func_t	report;
+	pthread_t		os_thread;		/* the scheduler's OS thread */
+	struct _th_system_t *sched;
+	struct _th_watchdog *next;		/* watcher list */
+
+	thread_t * volatile	slice_th;	/* NULL while in the scheduler */
+	volatile uint64_t	slice_start_ns;
+	volatile uint32_t	slice_seq;
+	volatile uint32_t	probe_seq;	/* slice the watcher asked a backtrace of */
+	volatile uint32_t	trace_seq;	/* slice the backtrace below belongs to */
+	uint32_t		stall_seq;		/* slice already reported as stalled, watcher only */
+	int				trace_depth;
+	void			*trace[THREAD_WD_MAX_DEPTH];
+} th_watchdog_t;
+
+struct _th_system_t {
+	thread_t *main_thread;
+	thread_t *active_thread;
+	thread_t active_thread_slot[MAX_THREAD];
+	thread_t *free_thread_list;
+	int count;
+	int ready_count;
+	int sleep_count;
+	uint64_t start;
+
+	/* arena chunk cache */
+	th_arena_chunk_t *chunk_cache;
+	int chunk_cache_count;
+
+	/* deadline min-heap (1-based) of sleeping threads and timers */
+	th_deadline_t **heap;
+	int heap_count;
+	int heap_size;
+	th_sigqueue_t *sigq_free;
+
+	/* cross-thread wakeups, pushed lock-free and drained in thread_yield */
+	th_remote_t *remote_head;
+	int wake_fd[2];			/* pipe to break the idle wait, -1 until needed */
+
+	/* statistics */
+	uint64_t switches;
+	uint64_t long_slices;
+	uint64_t ready_waits;
+	uint64_t max_slice_ns;
+	uint64_t max_wait_ns;
+	th_watchdog_t *watchdog;	/* NULL when off */
+
+	/* terminated threads waiting to be freed */
+	thread_t *reap_list;
+	int reap_count;
+
+	/* simulation: time only moves when everyone waits, seeded pick order */
+	int virtual_clock;
+	uint64_t vclock_ms;
+	uint64_t rng;
+
+	struct _th_export *export;	/* NULL when not exported */
+	int export_rescan;			/* slot whose stack gets the next exact scan */
+};
+
+typedef struct _th_system_t th_system_t;
+
+/* the scheduler bound to the calling OS thread */
+extern __thread th_system_t *THREAD;
+
+/* thread.c */
+void thread_handoff(thread_t *from, thread_t *to);
+int thread_remote_prepare(th_system_t *s);
+void thread_remote_post(th_system_t *s, th_remote_t *r);
+
+/* watchdog.c */
+uint64_t thread_now_ns(void);
+void thread_watchdog_slice_end(th_system_t *s);
+void thread_watchdog_slice_begin(th_system_t *s, thread_t *th);
+void thread_watchdog_detach(th_system_t *s);
+
+/* stats.c */
+void thread_stats_detach(th_system_t *s);
+
+/* timer.c */
+void thread_deadline_insert(th_system_t *s, th_deadline_t *dl);
+void thread_deadline_remove(th_system_t *s, th_deadline_t *dl);
+void thread_deadline_expire(th_system_t *s, uint64_t now_ms);
+void thread_timer_free_all(th_system_t *s);
+uint64_t thread_tick_ms(th_system_t *s);
+
+/* arena.c */
+void thread_arena_release(thread_t *th);
+void thread_arena_cache_free(th_system_t *s);
+
+#endif /* _THREAD_INTERNAL_H_ */
@@ -0,0 +1,264 @@
+/*
+MIT License
+
+Copyright (c) 2020 Kevin Huang
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include "thread_internal.h"
+
+#define HEAP_INITIAL_SIZE	64
+
+#define TIMER_FIRING		0x1	/* popped, callback pending in this batch */
+#define TIMER_CANCELED		0x2	/* canceled while its batch is firing */
+
+struct _thread_timer {
+	th_deadline_t	tm_deadline;	/* must be first */
+	u_int			tm_period;
+	int				tm_flags;
+	timer_func_t	tm_func;
+	void			*tm_arg;
+	th_system_t		*tm_sched;
+	struct _thread_timer *tm_next;	/* fired batch */
+};
+
+#define DL_THREAD(dl)	((thread_t *)((char *)(dl) - offsetof(thread_t, th_wakeup)))
+#define DL_TIMER(dl)	((thread_timer_t *)(dl))
+
+/*
+ * deadline heap
+ */
+static void heap_set(th_system_t *s, int i, th_deadline_t *dl)
+{
+	s->heap[i] = dl;
+	dl->dl_index = i;
+}
+
+static void heap_up(th_system_t *s, int i)
+{
+	th_deadline_t *dl = s->heap[i];
+
+	while (i > 1 && s->heap[i/2]->expired_ms > dl->expired_ms) {
+		heap_set(s, i, s->heap[i/2]);
+		i /= 2;
+	}
+	heap_set(s, i, dl);
+}
+
+static void heap_down(th_system_t *s, int i)
+{
+	th_deadline_t *dl = s->heap[i];
+	int child;
+
+	while ((child = i*2) <= s->heap_count) {
+		if (child < s->heap_count &&
+			s->heap[child+1]->expired_ms < s->heap[child]->expired_ms)
+			child++;
+		if (s->heap[child]->expired_ms >= dl->expired_ms)
+			break;
+		heap_set(s, i, s->heap[child]);
+		i = child;
+	}
+	heap_set(s, i, dl);
+}
+
+void thread_deadline_insert(th_system_t *s, th_deadline_t *dl)
+{
+	if (dl->dl_index)
+		thread_deadline_remove(s, dl);
+
+	if (s->heap_count + 1 >= s->heap_size) {
+		int size = s->heap_size ? s->heap_size * 2 : HEAP_INITIAL_SIZE;
+		th_deadline_t **heap = (th_deadline_t **)realloc(s->heap, size * sizeof(th_deadline_t *));
+		if (heap == NULL) {
+			printf("Fatal error: no memory for the deadline heap\n");
+			exit(1);
+		}
+		s->heap = heap;
+		s->heap_size = size;
+	}
+
+	s->heap[++s->heap_count] = dl;
+	heap_up(s, s->heap_count);
+}
+
+void thread_deadline_remove(th_system_t *s, th_deadline_t *dl)
+{
+	th_deadline_t *last;
+	int i = dl->dl_index;
+
+	if (i == 0)
+		return; /* not queued */
+
+	dl->dl_index = 0;
+	if (i == s->heap_count) {
+		s->heap_count--;
+		return;
+	}
+
+	/* move the last entry into the hole and restore the order */
+	last = s->heap[s->heap_count--];
+	heap_set(s, i, last);
+	heap_up(s, i);
+	heap_down(s, last->dl_index);
+}
+
+static th_deadline_t *heap_pop(th_system_t *s)
+{
+	th_deadline_t *dl = s->heap[1];
+
+	dl->dl_index = 0;
+	if (--s->heap_count > 0) {
+		heap_set(s, 1, s->heap[s->heap_count + 1]);
+		heap_down(s, 1);
+	}
+	return dl;
+}
+
+/*
+ * wake every expired sleeper and fire every expired timer in one batch;
+ * periodic timers are rearmed only after all callbacks ran, so a short
+ * period cannot keep the batch going forever
+ */
+void thread_deadline_expire(th_system_t *s, uint64_t now_ms)
+{
+	thread_timer_t *fired = NULL, **tail = &fired;
+	thread_timer_t *tm, *next;
+	th_deadline_t *dl;
+	uint64_t missed;
+
+	while (s->heap_count && s->heap[1]->expired_ms <= now_ms) {
+		dl = heap_pop(s);
+		if (dl->dl_kind == DEADLINE_THREAD) {
+			thread_wake_up( DL_THREAD(dl) );
+		} else {
+			tm = DL_TIMER(dl);
+			tm->tm_flags |= TIMER_FIRING;
+			tm->tm_next = NULL;
+			*tail = tm;
+			tail = &tm->tm_next;
+		}
+	}
+
+	for (tm=fired; tm; tm=tm->tm_next) {
+		if (!(tm->tm_flags & TIMER_CANCELED))
+			tm->tm_func(tm, tm->tm_arg);
+	}
+
+	for (tm=fired; tm; tm=next) {
+		next = tm->tm_next;
+		tm->tm_flags &= ~TIMER_FIRING;
+
+		if (tm->tm_flags & TIMER_CANCELED) {
+			free(tm); /* the handle is dead from here on */
+		} else if (tm->tm_deadline.dl_index) {
+			continue; /* rescheduled by its callback */
+		} else if (tm->tm_period) {
+			/* keep the phase, skip the periods we missed */
+			missed = (now_ms - tm->tm_deadline.expired_ms) / tm->tm_period + 1;
+			tm->tm_deadline.expired_ms += missed * tm->tm_period;
+			thread_deadline_insert(s, &tm->tm_deadline);
+		} else {
+			/* one-shot timer is done, and so is its handle */
+			free(tm);
+		}
+	}
+}
+
+/*
+ * timers
+ */
+thread_timer_t *thread_timer_add(
+	u_int delay_ms,
+	u_int period_ms,
+	timer_func_t func,
+	void *arg)
+{
+	th_system_t *s;
+	thread_timer_t *tm;
+
+	if (!THREAD)
+		initial_thread_system();
+	s = THREAD;
+
+	if ((tm = (thread_timer_t *)malloc(sizeof(thread_timer_t))) == NULL)
+		return NULL;
+
+	tm->tm_deadline.expired_ms = thread_tick_ms(s) + delay_ms;
+	tm->tm_deadline.dl_index = 0;
+	tm->tm_deadline.dl_kind = DEADLINE_TIMER;
+	tm->tm_period = period_ms;
+	tm->tm_flags = 0;
+	tm->tm_func = func;
+	tm->tm_arg = arg;
+	tm->tm_sched = s;
+	tm->tm_next = NULL;
+
+	thread_deadline_insert(s, &tm->tm_deadline);
+	return tm;
+}
+
+int thread_timer_cancel(thread_timer_t *tm)
+{
+	th_system_t *s;
+
+	if (tm == NULL || (tm->tm_flags & TIMER_CANCELED))
+		return -1;
+
+	s = tm->tm_sched;
+	thread_deadline_remove(s, &tm->tm_deadline);
+	if (tm->tm_flags & TIMER_FIRING) {
+		/* released when its batch completes */
+		tm->tm_flags |= TIMER_CANCELED;
+		return 0;
+	}
+
+	free(tm);
+	return 0;
+}
+
+int thread_timer_reschedule(thread_timer_t *tm, u_int delay_ms, u_int period_ms)
+{
+	th_system_t *s;
+
+	if (tm == NULL || (tm->tm_flags & TIMER_CANCELED))
+		return -1;
+
+	s = tm->tm_sched;
+	tm->tm_deadline.expired_ms = thread_tick_ms(s) + delay_ms;
+	tm->tm_period = period_ms;
+	thread_deadline_insert(s, &tm->tm_deadline);
+	return 0;
+}
+
+void thread_timer_free_all(th_system_t *s)
+{
+	int i;
+
+	for (i=1; i<=s->heap_count; i++) {
+		if (s->heap[i]->dl_kind == DEADLINE_TIMER)
+			free(DL_TIMER(s->heap[i]));
+	}
+	free(s->heap);
+	s->heap = NULL;
+	s->heap_count = s->heap_size = 0;
+}
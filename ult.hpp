@@ -0,0 +1,431 @@
+/*
+MIT License
+
+Copyright (c) 2020 Kevin Huang
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#ifndef _ULT_HPP_
+#define _ULT_HPP_
+
+/*
+ * header-only C++ layer over the thread API
+ *
+ *   ult::fiber f = ult::spawn("worker", [&] { ... });
+ *   f.join();              // or let the destructor join
+ *
+ * captures that fit THREAD_INLINE_ARG_SIZE are stored in the thread slot
+ * itself, larger ones fall back to the heap. With C++20, coroutines
+ * returning ult::task can co_await ult::sleep_for(), an ult::event or
+ * ult::channel<T>::recv_async() on the same scheduler (plain recv()
+ * blocks the whole fiber); they are resumed from timer callbacks, so
+ * they must not call blocking thread_* functions
+ */
+
+#include <new>
+#include <deque>
+#include <utility>
+#include <type_traits>
+#include "thread.h"
+
+#if __cplusplus >= 202002L
+#include <coroutine>
+#include <exception>
+#include <optional>
+#endif
+
+namespace ult {
+
+class fiber;
+
+/* an empty (non-joinable) handle means the thread could not be created */
+template <class F>
+fiber spawn(const char *name, F &&f, int stacksize = THREAD_DEFAULT_STACK_SIZE);
+
+namespace detail {
+
+template <class Fn>
+struct box {
+	fiber	*owner;		/* join handle, NULL once detached */
+	Fn		fn;
+};
+
+template <class Fn>
+constexpr bool fits_inline =
+	sizeof(box<Fn>) <= THREAD_INLINE_ARG_SIZE &&
+	alignof(box<Fn>) <= alignof(decltype(thread_t::th_inline));
+
+template <class Fn>
+void entry(void *param) noexcept;
+
+} /* namespace detail */
+
+/* move-only join handle, joins on destruction unless detached */
+class fiber {
+public:
+	fiber() noexcept = default;
+
+	fiber(fiber &&o) noexcept
+	{
+		take(o);
+	}
+
+	fiber &operator=(fiber &&o) noexcept
+	{
+		if (this != &o) {
+			if (joinable())
+				join();
+			take(o);
+		}
+		return *this;
+	}
+
+	fiber(const fiber &) = delete;
+	fiber &operator=(const fiber &) = delete;
+
+	~fiber()
+	{
+		if (joinable())
+			join();
+	}
+
+	bool joinable() const noexcept { return th_ != nullptr; }
+	explicit operator bool() const noexcept { return joinable(); }
+	thread_t *native_handle() const noexcept { return th_; }
+
+	void join()
+	{
+		while (!done_) {
+			waiter_ = thread_self();
+			thread_suspend(NULL);
+		}
+		reset();
+	}
+
+	void detach() noexcept
+	{
+		if (!done_ && owner_)
+			*owner_ = nullptr;
+		reset();
+	}
+
+private:
+	template <class Fn> friend void detail::entry(void *param) noexcept;
+	template <class F> friend fiber spawn(const char *name, F &&f, int stacksize);
+
+	void take(fiber &o) noexcept
+	{
+		th_ = o.th_;
+		done_ = o.done_;
+		waiter_ = o.waiter_;
+		owner_ = o.owner_;
+		if (!done_ && owner_)
+			*owner_ = this; /* the running fiber reports to the new handle */
+		o.reset();
+	}
+
+	void reset() noexcept
+	{
+		th_ = nullptr;
+		done_ = true;
+		waiter_ = nullptr;
+		owner_ = nullptr;
+	}
+
+	void finish() noexcept
+	{
+		done_ = true;
+		if (waiter_)
+			thread_resume_force(waiter_);
+	}
+
+	thread_t	*th_ = nullptr;
+	bool		done_ = true;
+	thread_t	*waiter_ = nullptr;	/* thread blocked in join() */
+	fiber		**owner_ = nullptr;	/* back pointer held by the running fiber */
+};
+
+namespace detail {
+
+template <class Fn>
+void entry(void *param) noexcept
+{
+	box<Fn> *b = static_cast<box<Fn> *>(param);
+	fiber *owner;
+
+	b->fn();
+
+	owner = b->owner;
+	if constexpr (fits_inline<Fn>)
+		b->~box<Fn>();
+	else
+		delete b;
+
+	if (owner)
+		owner->finish();
+}
+
+} /* namespace detail */
+
+template <class F>
+fiber spawn(const char *name, F &&f, int stacksize)
+{
+	using Fn = std::decay_t<F>;
+	fiber h;
+	thread_t *th;
+	detail::box<Fn> *b;
+
+	if constexpr (detail::fits_inline<Fn>) {
+		if ((th = thread_create(name, &detail::entry<Fn>, NULL, stacksize)) == NULL)
+			return h;
+
+		/* the new thread has not run yet, fill in its argument */
+		try {
+			b = new (&th->th_inline) detail::box<Fn>{&h, std::forward<F>(f)};
+		} catch (...) {
+			thread_terminate(th); /* never let it run without an argument */
+			throw;
+		}
+		th->th_param = b;
+	} else {
+		/* box first, a throwing copy or bad_alloc leaves no thread behind */
+		b = new detail::box<Fn>{&h, std::forward<F>(f)};
+		if ((th = thread_create(name, &detail::entry<Fn>, b, stacksize)) == NULL) {
+			delete b;
+			return h;
+		}
+	}
+
+	h.th_ = th;
+	h.done_ = false;
+	h.owner_ = &b->owner;
+	return h;
+}
+
+template <class F>
+fiber spawn(F &&f)
+{
+	return spawn("ult::fiber", std::forward<F>(f));
+}
+
+#if __cplusplus >= 202002L
+
+/* detached, eagerly started coroutine */
+struct task {
+	struct promise_type {
+		task get_return_object() noexcept { return {}; }
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() noexcept {}
+		void unhandled_exception() noexcept { std::terminate(); }
+	};
+};
+
+namespace detail {
+
+inline void resume_timer(thread_timer_t *, void *arg)
+{
+	std::coroutine_handle<>::from_address(arg).resume();
+}
+
+/* resume H from the scheduler after DELAY_MS, false if no timer could be set */
+inline bool post(std::coroutine_handle<> h, u_int delay_ms = 0)
+{
+	return thread_timer_add(delay_ms, 0, resume_timer, h.address()) != NULL;
+}
+
+/* waiter on an event or channel, lives on the fiber stack or coroutine frame */
+struct wait_node {
+	wait_node	*next = nullptr;
+	thread_t	*th = nullptr;
+	void		*coro = nullptr;
+	bool		woken = false;
+
+	void wake()
+	{
+		woken = true;
+		if (th)
+			thread_resume_force(th);
+		else if (!post(std::coroutine_handle<>::from_address(coro)))
+			std::coroutine_handle<>::from_address(coro).resume(); /* no timer, run it here */
+	}
+
+	/* block the calling fiber until woken */
+	void wait()
+	{
+		th = thread_self();
+		while (!woken)
+			thread_suspend(NULL);
+	}
+};
+
+struct wait_list {
+	wait_node	*head = nullptr;
+	wait_node	*tail = nullptr;
+
+	void push(wait_node *n)
+	{
+		n->next = nullptr;
+		if (tail)
+			tail->next = n;
+		else
+			head = n;
+		tail = n;
+	}
+
+	wait_node *pop()
+	{
+		wait_node *n = head;
+		if (n && (head = n->next) == nullptr)
+			tail = nullptr;
+		return n;
+	}
+};
+
+} /* namespace detail */
+
+/* co_await ult::sleep_for(ms) */
+struct sleep_for {
+	u_int ms;
+
+	explicit sleep_for(u_int msecs) : ms(msecs) {}
+	bool await_ready() const noexcept { return false; }
+	/* without a timer the coroutine goes on at once rather than never */
+	bool await_suspend(std::coroutine_handle<> h) const { return detail::post(h, ms); }
+	void await_resume() const noexcept {}
+};
+
+/* manual-reset event for fibers (wait) and coroutines (co_await) */
+class event {
+public:
+	bool is_set() const noexcept { return set_; }
+	void reset() noexcept { set_ = false; }
+
+	void set()
+	{
+		detail::wait_node *n;
+
+		set_ = true;
+		while ((n = waiters_.pop()) != nullptr)
+			n->wake();
+	}
+
+	void wait()
+	{
+		detail::wait_node n;
+
+		if (set_)
+			return;
+		waiters_.push(&n);
+		n.wait();
+	}
+
+	struct awaiter {
+		event				&ev;
+		detail::wait_node	node;
+
+		bool await_ready() const noexcept { return ev.set_; }
+		void await_suspend(std::coroutine_handle<> h)
+		{
+			node.coro = h.address();
+			ev.waiters_.push(&node);
+		}
+		void await_resume() const noexcept {}
+	};
+
+	awaiter operator co_await() noexcept { return awaiter{*this, {}}; }
+
+private:
+	bool				set_ = false;
+	detail::wait_list	waiters_;
+};
+
+/* unbounded channel, send() never blocks */
+template <class T>
+class channel {
+	struct node : detail::wait_node {
+		std::optional<T> value;
+	};
+
+public:
+	void send(T value)
+	{
+		node *n = static_cast<node *>(receivers_.pop());
+
+		if (n) {
+			/* hand it straight to the oldest receiver */
+			n->value.emplace(std::move(value));
+			n->wake();
+		} else {
+			queue_.push_back(std::move(value));
+		}
+	}
+
+	/* fiber side, blocks the calling thread */
+	T recv()
+	{
+		node n;
+
+		if (!queue_.empty())
+			return pop();
+		receivers_.push(&n);
+		n.wait();
+		return std::move(*n.value);
+	}
+
+	struct recv_awaiter {
+		channel	&ch;
+		node	n;
+
+		bool await_ready() const noexcept { return !ch.queue_.empty(); }
+		void await_suspend(std::coroutine_handle<> h)
+		{
+			n.coro = h.address();
+			ch.receivers_.push(&n);
+		}
+		T await_resume()
+		{
+			if (n.value)
+				return std::move(*n.value);
+			return ch.pop();
+		}
+	};
+
+	/* coroutine side, co_await ch.recv_async() */
+	recv_awaiter recv_async() { return recv_awaiter{*this, {}}; }
+
+	bool empty() const noexcept { return queue_.empty(); }
+
+private:
+	T pop()
+	{
+		T v = std::move(queue_.front());
+		queue_.pop_front();
+		return v;
+	}
+
+	std::deque<T>		queue_;
+	detail::wait_list	receivers_;
+};
+
+#endif /* __cplusplus >= 202002L */
+
+} /* namespace ult */
+
+#endif /* _ULT_HPP_ */
@@ -0,0 +1,199 @@
+/*
+MIT License
+
+Copyright (c) 2020 Kevin Huang
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+/*
+ * ultop: top-like view of a scheduler published with thread_stats_export()
+ *
+ * usage: ultop <stats file> [interval ms]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "ultstat.h"
+
+static const char *STATE_NAME[ULTSTAT_NUM_STATE] = {
+	"READY", "SUSPEND", "SLEEP", "TERM", "CLEAR"
+};
+
+typedef struct _row {
+	ultstat_thread_t *t;
+	long delta;		/* schedules since the last refresh */
+} row_t;
+
+/* copy a consistent snapshot, retry while the scheduler is writing */
+static int snapshot(const ultstat_header_t *map, ultstat_header_t *copy, size_t size)
+{
+	uint32_t seq;
+	int tries;
+
+	for (tries=0; tries<1000; tries++) {
+		seq = __atomic_load_n(&map->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) {
+			usleep(100);
+			continue;
+		}
+		memcpy(copy, map, size);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&map->seq, __ATOMIC_RELAXED) == seq)
+			return 0;
+	}
+
+	return -1;
+}
+
+static int row_compare(const void *a, const void *b)
+{
+	const row_t *ra = (const row_t *)a, *rb = (const row_t *)b;
+
+	if (ra->delta != rb->delta)
+		return ra->delta < rb->delta ? 1 : -1;
+	return (int)ra->t->slot - (int)rb->t->slot;
+}
+
+static long accum_delta(const ultstat_thread_t *t, const ultstat_header_t *prev)
+{
+	uint32_t i;
+
+	if (prev == NULL)
+		return 0;
+
+	for (i=0; i<prev->nthreads; i++) {
+		const ultstat_thread_t *p = &prev->thread[i];
+		if (p->slot == t->slot && strcmp(p->name, t->name) == 0)
+			return t->accum >= p->accum ? (long)(t->accum - p->accum) : (long)t->accum;
+	}
+
+	return t->accum; /* new thread */
+}
+
+static void show(const ultstat_header_t *h, const ultstat_header_t *prev, row_t *rows)
+{
+	double secs = prev ? (h->publish_ms - prev->publish_ms) / 1000.0 : 0;
+	uint32_t i;
+
+	printf("\033[H\033[2J");
+	printf("pid %u  threads %d  ready %d  sleep %d  switches %llu",
+		h->pid, h->count, h->ready_count, h->sleep_count,
+		(unsigned long long)h->switches);
+	if (secs > 0)
+		printf(" (%.0f/s)", (h->switches - prev->switches) / secs);
+	printf("\n");
+	printf("watchdog: long slices %llu (max %.1f ms)  ready waits %llu (max %.1f ms)\n\n",
+		(unsigned long long)h->long_slices, h->max_slice_ns / 1e6,
+		(unsigned long long)h->ready_waits, h->max_wait_ns / 1e6);
+
+	for (i=0; i<h->nthreads; i++) {
+		rows[i].t = (ultstat_thread_t *)&h->thread[i];
+		rows[i].delta = accum_delta(rows[i].t, prev);
+	}
+	qsort(rows, h->nthreads, sizeof(row_t), row_compare);
+
+	printf("%4s %-32s %-8s %8s %8s %8s %8s %10s\n",
+		"SLOT", "NAME", "STATE", "SCHED", "READY", "SUSPEND", "SLEEP", "STACK");
+	for (i=0; i<h->nthreads; i++) {
+		const ultstat_thread_t *t = rows[i].t;
+		char stack[48];
+
+		if (t->stack_size)
+			snprintf(stack, sizeof(stack), "%lluK/%lluK",
+				(unsigned long long)(t->stack_used / 1024),
+				(unsigned long long)(t->stack_size / 1024));
+		else
+			snprintf(stack, sizeof(stack), "-");
+
+		printf("%4u %-32s %-8s %8ld %8u %8u %8u %10s\n",
+			t->slot, t->name,
+			t->state < ULTSTAT_NUM_STATE ? STATE_NAME[t->state] : "?",
+			rows[i].delta,
+			t->accum_switch[0], t->accum_switch[1], t->accum_switch[2],
+			stack);
+	}
+	fflush(stdout);
+}
+
+int
+main(int argc, char **argv)
+{
+	ultstat_header_t *map, *cur, *prev;
+	row_t *rows;
+	struct stat st;
+	size_t size;
+	int fd, interval = 1000;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s <stats file> [interval ms]\n", argv[0]);
+		return 1;
+	}
+	if (argc > 2)
+		interval = atoi(argv[2]);
+
+	if ((fd = open(argv[1], O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+		perror(argv[1]);
+		return 1;
+	}
+
+	size = st.st_size;
+	if (size < sizeof(ultstat_header_t)) {
+		fprintf(stderr, "%s: not a stats file\n", argv[1]);
+		return 1;
+	}
+
+	map = (ultstat_header_t *)mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+
+	if (__atomic_load_n(&map->magic, __ATOMIC_ACQUIRE) != ULTSTAT_MAGIC ||
+		map->version != ULTSTAT_VERSION || ULTSTAT_SIZE(map->max_threads) > size) {
+		fprintf(stderr, "%s: not a stats file\n", argv[1]);
+		return 1;
+	}
+
+	cur = (ultstat_header_t *)malloc(size);
+	prev = (ultstat_header_t *)malloc(size);
+	rows = (row_t *)malloc(map->max_threads * sizeof(row_t));
+	if (cur == NULL || prev == NULL || rows == NULL)
+		return 1;
+
+	if (snapshot(map, prev, size) < 0)
+		return 1;
+	show(prev, NULL, rows);
+
+	while (1) {
+		usleep(interval * 1000);
+		if (snapshot(map, cur, size) < 0)
+			continue;
+		if (cur->publish_ms == prev->publish_ms)
+			continue; /* nothing new */
+
+		show(cur, prev, rows);
+		memcpy(prev, cur, size);
+	}
+
+	return 0;
+}
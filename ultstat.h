@@ -0,0 +1,71 @@
+/*
+MIT License
+
+Copyright (c) 2020 Kevin Huang
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#ifndef _ULTSTAT_H_
+#define _ULTSTAT_H_
+
+/*
+ * layout of the scheduler stats file written by thread_stats_export()
+ * and read by ultop; readers retry while seq is odd or changed
+ */
+
+#include <stdint.h>
+
+#define ULTSTAT_MAGIC		0x554c5453	/* "ULTS" */
+#define ULTSTAT_VERSION		1
+#define ULTSTAT_NAME_LEN	32
+#define ULTSTAT_NUM_STATE	5			/* THREAD_NUM_STATE */
+
+typedef struct _ultstat_thread {
+	char		name[ULTSTAT_NAME_LEN];
+	uint32_t	slot;
+	uint32_t	state;
+	uint32_t	accum;
+	uint32_t	accum_switch[ULTSTAT_NUM_STATE];
+	uint64_t	stack_size;
+	uint64_t	stack_used;		/* high-water mark, 0 when unknown */
+} ultstat_thread_t;
+
+typedef struct _ultstat_header {
+	uint32_t	magic;
+	uint32_t	version;
+	uint32_t	seq;			/* odd while the scheduler writes */
+	uint32_t	pid;
+	uint64_t	publish_ms;		/* wall clock of the last publish */
+	uint32_t	period_ms;
+	uint32_t	max_threads;	/* entries allocated after the header */
+	uint32_t	nthreads;		/* entries in use */
+	int32_t		count;
+	int32_t		ready_count;
+	int32_t		sleep_count;
+	uint64_t	switches;
+	uint64_t	long_slices;
+	uint64_t	ready_waits;
+	uint64_t	max_slice_ns;
+	uint64_t	max_wait_ns;
+	ultstat_thread_t thread[];
+} ultstat_header_t;
+
+#define ULTSTAT_SIZE(n)	(sizeof(ultstat_header_t) + (n) * sizeof(ultstat_thread_t))
+
+#endif /* _ULTSTAT_H_ */
@@ -0,0 +1,318 @@
+/*
+MIT License
+
+Copyright (c) 2020 Kevin Huang
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE	/* dladdr */
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <dlfcn.h>
+#include "thread_internal.h"
+
+/*
+ * watchdog: the scheduler stamps every slice, a watcher pthread looks
+ * for slices that run past the threshold and signals the scheduler's OS
+ * thread to capture a backtrace while the slice is still running; the
+ * watcher reports the stall as soon as the trace is in, and the
+ * scheduler reports the full length once the slice ends (if ever)
+ */
+#define WD_SIGNAL		SIGURG
+#define WD_POLL_MAX_NS	10000000ull	/* 10ms */
+
+static pthread_mutex_t WD_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t WD_COND = PTHREAD_COND_INITIALIZER;
+static th_watchdog_t *WD_LIST;
+static int WD_STARTED;
+static struct sigaction WD_OLD_ACTION;	/* restored when the last watchdog stops */
+
+uint64_t thread_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void wd_default_report(const thread_watchdog_event_t *ev)
+{
+	Dl_info info;
+	int i;
+
+	fprintf(stderr, "watchdog: [%s] %s %llu ms\n",
+		ev->name ? ev->name : "?",
+		ev->kind == THREAD_WD_LONG_SLICE ? "ran without yielding for" :
+		ev->kind == THREAD_WD_STALLED ? "still running without yielding after" :
+		"waited ready for",
+		(unsigned long long)(ev->duration_ns / 1000000));
+	for (i=0; i<ev->depth; i++) {
+		if (dladdr(ev->pc[i], &info) && info.dli_sname)
+			fprintf(stderr, "    #%d %p %s\n", i, ev->pc[i], info.dli_sname);
+		else
+			fprintf(stderr, "    #%d %p\n", i, ev->pc[i]);
+	}
+}
+
+/* runs on the scheduler's OS thread */
+static void wd_signal_handler(int sig, siginfo_t *info, void *uctx)
+{
+	th_system_t *s = THREAD;
+	th_watchdog_t *wd;
+	uint32_t seq;
+
+	if (s == NULL || (wd = s->watchdog) == NULL)
+		return;
+
+	seq = wd->probe_seq;
+	if (seq != wd->slice_seq || wd->slice_th == NULL)
+		return; /* the slice ended meanwhile */
+
+	wd->trace_depth = platform_backtrace(wd->slice_th, uctx, wd->trace, THREAD_WD_MAX_DEPTH);
+	__atomic_store_n(&wd->trace_seq, seq, __ATOMIC_RELEASE);
+}
+
+/*
+ * report a slice that is still running, from the watcher with WD_LOCK
+ * held; the thread slot lives in the scheduler, so reading it is safe
+ * even if the slice ends meanwhile
+ */
+static void wd_report_stall(th_watchdog_t *wd, uint32_t seq, thread_t *th, uint64_t duration, int with_trace)
+{
+	thread_watchdog_event_t ev;
+
+	wd->stall_seq = seq;
+	ev.kind = THREAD_WD_STALLED;
+	ev.th = th;
+	ev.name = th->th_name;
+	ev.duration_ns = duration;
+	ev.depth = 0;
+	if (with_trace) {
+		ev.depth = wd->trace_depth;
+		memcpy(ev.pc, wd->trace, ev.depth * sizeof(void *));
+	}
+	wd->report(&ev);
+}
+
+static void *wd_watcher(void *arg)
+{
+	th_watchdog_t *wd;
+	struct timespec ts;
+	uint64_t now, start, poll_ns;
+	thread_t *th;
+	uint32_t seq;
+
+	pthread_mutex_lock(&WD_LOCK);
+	while (1) {
+		if (WD_LIST == NULL) {
+			pthread_cond_wait(&WD_COND, &WD_LOCK);
+			continue;
+		}
+
+		now = thread_now_ns();
+		poll_ns = WD_POLL_MAX_NS;
+		for (wd=WD_LIST; wd; wd=wd->next) {
+			if (wd->slice_ns && wd->slice_ns / 2 < poll_ns)
+				poll_ns = wd->slice_ns / 2;
+
+			seq = __atomic_load_n(&wd->slice_seq, __ATOMIC_ACQUIRE);
+			start = wd->slice_start_ns;
+			th = wd->slice_th;
+			if (th == NULL || seq != wd->slice_seq)
+				continue; /* idle or just switched */
+			if (!wd->slice_ns || now <= start + wd->slice_ns || wd->stall_seq == seq)
+				continue;
+
+			if (wd->probe_seq != seq) {
+				wd->probe_seq = seq;
+				pthread_kill(wd->os_thread, WD_SIGNAL);
+			} else if (__atomic_load_n(&wd->trace_seq, __ATOMIC_ACQUIRE) == seq) {
+				wd_report_stall(wd, seq, th, now - start, 1);
+			} else if (now > start + 2 * wd->slice_ns) {
+				/* the probe never landed, report without a trace */
+				wd_report_stall(wd, seq, th, now - start, 0);
+			}
+		}
+
+		pthread_mutex_unlock(&WD_LOCK);
+		ts.tv_sec = 0;
+		ts.tv_nsec = poll_ns ? poll_ns : WD_POLL_MAX_NS;
+		nanosleep(&ts, NULL);
+		pthread_mutex_lock(&WD_LOCK);
+	}
+
+	return NULL;
+}
+
+static void wd_report(th_system_t *s, int kind, thread_t *th, uint64_t duration, int with_trace)
+{
+	th_watchdog_t *wd = s->watchdog;
+	thread_watchdog_event_t ev;
+
+	ev.kind = kind;
+	ev.th = th;
+	ev.name = th->th_name;
+	ev.duration_ns = duration;
+	ev.depth = 0;
+	if (with_trace) {
+		ev.depth = wd->trace_depth;
+		memcpy(ev.pc, wd->trace, ev.depth * sizeof(void *));
+	}
+	wd->report(&ev);
+}
+
+void thread_watchdog_slice_end(th_system_t *s)
+{
+	th_watchdog_t *wd = s->watchdog;
+	thread_t *th = wd->slice_th;
+	uint64_t now, duration;
+
+	if (th == NULL)
+		return;
+
+	now = thread_now_ns();
+	duration = now - wd->slice_start_ns;
+	wd->slice_th = NULL;
+
+	if (duration > s->max_slice_ns)
+		s->max_slice_ns = duration;
+	if (wd->slice_ns && duration > wd->slice_ns) {
+		s->long_slices++;
+		wd_report(s, THREAD_WD_LONG_SLICE, th, duration,
+			__atomic_load_n(&wd->trace_seq, __ATOMIC_ACQUIRE) == wd->slice_seq);
+	}
+
+	/* a thread that stays READY starts waiting now */
+	if (th->th_state == THREAD_STATE_READY)
+		th->th_ready_ns = now;
+}
+
+void thread_watchdog_slice_begin(th_system_t *s, thread_t *th)
+{
+	th_watchdog_t *wd = s->watchdog;
+	uint64_t now = thread_now_ns(), wait;
+
+	if (th->th_ready_ns) {
+		wait = now - th->th_ready_ns;
+		th->th_ready_ns = 0;
+		if (wait > s->max_wait_ns)
+			s->max_wait_ns = wait;
+		if (wd->wait_ns && wait > wd->wait_ns) {
+			s->ready_waits++;
+			wd_report(s, THREAD_WD_READY_WAIT, th, wait, 0);
+		}
+	}
+
+	wd->slice_start_ns = now;
+	wd->slice_th = th;
+	__atomic_store_n(&wd->slice_seq, wd->slice_seq + 1, __ATOMIC_RELEASE);
+}
+
+/* must be called on the scheduler's own OS thread */
+int thread_watchdog_start(u_int slice_ms, u_int wait_ms, watchdog_func_t report)
+{
+	th_system_t *s;
+	th_watchdog_t *wd;
+	struct sigaction sa;
+	pthread_t watcher;
+
+	if (!THREAD)
+		initial_thread_system();
+	s = THREAD;
+
+	if (s->watchdog)
+		return -1; /* already running */
+
+	if ((wd = (th_watchdog_t *)calloc(1, sizeof(th_watchdog_t))) == NULL)
+		return -1;
+	wd->slice_ns = (uint64_t)slice_ms * 1000000;
+	wd->wait_ns = (uint64_t)wait_ms * 1000000;
+	wd->report = report ? report : wd_default_report;
+	wd->os_thread = pthread_self();
+	wd->sched = s;
+
+	pthread_mutex_lock(&WD_LOCK);
+	if (!WD_STARTED) {
+		if (pthread_create(&watcher, NULL, wd_watcher, NULL) != 0) {
+			pthread_mutex_unlock(&WD_LOCK);
+			free(wd);
+			return -1;
+		}
+		pthread_detach(watcher);
+		WD_STARTED = 1;
+	}
+
+	if (WD_LIST == NULL) {
+		/* first watchdog, borrow the signal and keep the application's action */
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_sigaction = wd_signal_handler;
+		sa.sa_flags = SA_SIGINFO | SA_RESTART;
+		sigemptyset(&sa.sa_mask);
+		if (sigaction(WD_SIGNAL, &sa, &WD_OLD_ACTION) < 0) {
+			pthread_mutex_unlock(&WD_LOCK);
+			free(wd);
+			return -1;
+		}
+	}
+
+	/* the running thread's slice starts now */
+	s->watchdog = wd;
+	thread_watchdog_slice_begin(s, s->active_thread);
+
+	wd->next = WD_LIST;
+	WD_LIST = wd;
+	pthread_cond_signal(&WD_COND);
+	pthread_mutex_unlock(&WD_LOCK);
+
+	return 0;
+}
+
+void thread_watchdog_stop(void)
+{
+	if (THREAD)
+		thread_watchdog_detach(THREAD);
+}
+
+void thread_watchdog_detach(th_system_t *s)
+{
+	th_watchdog_t *wd, **pp;
+
+	if ((wd = s->watchdog) == NULL)
+		return;
+
+	s->watchdog = NULL; /* the signal handler checks this first */
+
+	pthread_mutex_lock(&WD_LOCK);
+	for (pp=&WD_LIST; *pp; pp=&(*pp)->next) {
+		if (*pp == wd) {
+			*pp = wd->next;
+			break;
+		}
+	}
+	if (WD_LIST == NULL)
+		sigaction(WD_SIGNAL, &WD_OLD_ACTION, NULL); /* last one out */
+	pthread_mutex_unlock(&WD_LOCK);
+
+	free(wd);
+}